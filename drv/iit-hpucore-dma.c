@@ -2,6 +2,7 @@
  *           HeadProcessorUnit (HPUCore) Linux driver.
  *
  * - this version uses scatter-gather (no cyclic) DMA -
+ * - RX descriptors can optionally be reused (see rx_reuse parameter) -
  *
  * For streaming engineering test through char interface.
  * May need to be ported to IIO framework exploiting fast iio from
@@ -38,19 +39,28 @@
 #include <linux/clk.h>
 #include <linux/debugfs.h>
 #include <linux/device.h>
+#include <linux/eventfd.h>
 #include <linux/fs.h>
+#include <linux/hrtimer.h>
 #include <linux/kernel.h>
 #include <linux/kthread.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/of_platform.h>
+#include <linux/percpu.h>
+#include <linux/poll.h>
+#include <linux/scatterlist.h>
 #include <linux/semaphore.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/types.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/vmalloc.h>
 #include <linux/wait.h>
 #include <linux/kdev_t.h>
 #include <linux/dmaengine.h>
 #include <linux/dma-mapping.h>
-#include <linux/dmapool.h>
 #include <linux/interrupt.h>
 #include <linux/stringify.h>
 #include <linux/version.h>
@@ -67,6 +77,18 @@
 #define HPU_RX_POOL_NUM 1024 /* must, must, must, must be a power of 2 */
 #define HPU_RX_TO_MS 100000
 
+/* RX adaptive TLAST timeout */
+#define HPU_RX_COAL_PERIOD_MS 100
+#define HPU_RX_COAL_RATE_HIGH 4000 /* buffers per second */
+#define HPU_RX_COAL_RATE_LOW 500 /* buffers per second */
+#define HPU_RX_COAL_MAX_US 1000000
+
+/* max fixed RX latency (HPU_IOCTL_SET_AXIS_LATENCY), in mS */
+#define HPU_AXIS_LAT_MAX_MS 60000
+
+/* RX busy-poll */
+#define HPU_RX_BUSY_POLL_MAX_US 10000
+
 /* TX DMA pool */
 #define HPU_TX_POOL_SIZE 4096
 #define HPU_TX_POOL_NUM 128 /* must, must, must, must be a power of 2 */
@@ -285,6 +307,70 @@
 #define HPU_IOCTL_SET_SPINN_KEYS_EN_EX		39
 #define HPU_IOCTL_SET_RX_TS_ENABLE		40
 #define HPU_IOCTL_SET_TX_TS_ENABLE		41
+#define HPU_IOCTL_RX_RING_SYNC			42
+#define HPU_IOCTL_SET_AXIS_LATENCY_ADAPTIVE	43
+#define HPU_IOCTL_SET_RX_BUSY_POLL		44
+#define HPU_IOCTL_GET_RX_WAKEUP_STATS		45
+#define HPU_IOCTL_SET_RX_META			46
+#define HPU_IOCTL_SET_RING_GEOMETRY		47
+#define HPU_IOCTL_SET_RX_OVERFLOW_RECOVERY	48
+#define HPU_IOCTL_GET_RX_LOSS_STATS		49
+#define HPU_IOCTL_SET_RX_MAX_LAG		50
+#define HPU_IOCTL_SET_RX_SHARE			51
+#define HPU_IOCTL_SET_RX_FORMAT			52
+#define HPU_IOCTL_SET_RX_SOURCES		53
+#define HPU_IOCTL_TX_RING_SUBMIT		54
+#define HPU_IOCTL_SET_TX_DMA_CFG		55
+#define HPU_IOCTL_SET_TX_WC			56
+#define HPU_IOCTL_SET_TX_ISSUE_POLICY		57
+#define HPU_IOCTL_GET_TX_LAT_STATS		58
+#define HPU_IOCTL_SET_TX_EVENTFD		59
+#define HPU_IOCTL_GET_TX_BYTES_DONE		60
+#define HPU_IOCTL_SET_TX_QUEUE			61
+#define HPU_IOCTL_SET_TX_PATTERN		62
+#define HPU_IOCTL_GET_TX_PATTERN_STATS		63
+#define HPU_IOCTL_GET_STATS			64
+#define HPU_IOCTL_RESET_STATS			65
+
+/* hpu_rx_meta_t flags */
+#define HPU_RX_META_EARLY_TLAST		BIT(0)
+#define HPU_RX_META_GAP			BIT(1)
+
+/* RX event source, in the event address, and HPU_IOCTL_SET_RX_SOURCES bits */
+#define HPU_RX_SRC_MSK			0x00300000
+#define HPU_RX_SRC_SHIFT		20
+#define HPU_RX_SRC_LEFT			BIT(0)
+#define HPU_RX_SRC_RIGHT		BIT(1)
+#define HPU_RX_SRC_AUX			BIT(2)
+#define HPU_RX_SRC_ALL			(HPU_RX_SRC_LEFT | HPU_RX_SRC_RIGHT | \
+					 HPU_RX_SRC_AUX)
+
+/* rings geometry limits for HPU_IOCTL_SET_RING_GEOMETRY */
+#define HPU_RING_MAX_PN			65536
+#define HPU_RING_MAX_SIZE		(64 * 1024 * 1024)
+
+/* mmap() offsets of the areas that can be mapped by userspace */
+#define HPU_MMAP_CTRL_OFFS		0x00000000
+#define HPU_MMAP_RX_RING_OFFS		0x10000000
+#define HPU_MMAP_TX_RING_OFFS		0x20000000
+
+/* user pages sent at once by a zero-copy write() */
+#define HPU_TX_ZC_MAX_PAGES		256
+
+/* max time a write-combined TX buffer is held back */
+#define HPU_TX_WC_MAX_US		1000000
+
+/* timed TX queue limits, in events, and events moved to the ring at once */
+#define HPU_TX_QUEUE_DEF_EVENTS		65536
+#define HPU_TX_QUEUE_MAX_EVENTS		(16 * 1024 * 1024)
+#define HPU_TX_QUEUE_MAX_AHEAD_US	10000000
+#define HPU_TX_QUEUE_BATCH		256
+
+/* TX pattern loops kept queued to the DMA, at least */
+#define HPU_TX_PATTERN_MIN_DEPTH	2
+
+/* driver statistics histograms: bucket n counts values in [2^(n-1), 2^n) */
+#define HPU_STATS_HIST_LEN		24
 
 static struct debugfs_reg32 hpu_regs[] = {
 	{"HPU_CTRL_REG",		0x00},
@@ -340,6 +426,14 @@ MODULE_PARM_DESC(rx_pn, "RX Pool num");
 module_param(rx_to, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
 MODULE_PARM_DESC(rx_to, "RX DMA TimeOut in ms");
 
+static short int rx_reuse = 0;
+module_param(rx_reuse, short, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(rx_reuse, "Set to 1 to reuse RX DMA descriptors");
+
+static int max_readers = 1;
+module_param(max_readers, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(max_readers, "Max number of times the device can be opened at once");
+
 static int tx_ps = HPU_TX_POOL_SIZE;
 static int tx_pn = HPU_TX_POOL_NUM;
 static int tx_to = HPU_TX_TO_MS;
@@ -462,6 +556,172 @@ typedef enum {
 	NOT_EMPTY
 } fifo_status_t;
 
+typedef struct {
+	u32 release;
+	u32 avail;
+	u32 first;
+} hpu_rx_ring_sync_t;
+
+typedef struct {
+	u32 enable;
+	u32 min_us;
+	u32 max_us;
+} hpu_axis_lat_adaptive_t;
+
+typedef struct {
+	u64 spin_count;
+	u64 spin_ns_tot;
+	u64 spin_ns_max;
+	u64 sleep_count;
+	u64 sleep_ns_tot;
+	u64 sleep_ns_max;
+} hpu_rx_wakeup_stats_t;
+
+typedef struct {
+	u64 produced;
+	u64 delivered;
+	u64 lost_overflow;
+	u64 lost_drain;
+	u64 lost_flush;
+	u64 overflows;
+} hpu_rx_loss_stats_t;
+
+typedef struct {
+	u64 time_ns;
+	u32 seq;
+	u32 len;
+	u32 flags;
+	u32 gap;
+} hpu_rx_meta_t;
+
+typedef enum {
+	RX_FORMAT_RAW,
+	RX_FORMAT_TS64,
+	RX_FORMAT_DELTA,
+} hpu_rx_format_t;
+
+/* RX event as read() returns it with RX_FORMAT_TS64 */
+typedef struct {
+	u32 ts_lo;
+	u32 ts_hi;
+	u32 addr;
+} hpu_rx_ts64_event_t;
+
+/*
+ * Sync point starting a block of delta encoded RX events (RX_FORMAT_DELTA):
+ * it's followed by count / 2 groups (rounded up) of two events, each group
+ * being a control byte and then the timestamp delta and the address XOR of
+ * each event. Each value takes 1 to 4 bytes (little endian), as told by two
+ * bits of the control byte, starting from the LSBs.
+ */
+typedef struct {
+	u32 ts_lo;
+	u32 ts_hi;
+	u32 count;
+} hpu_rx_delta_sync_t;
+
+typedef struct {
+	u32 rx_ps;
+	u32 rx_pn;
+	u32 tx_ps;
+	u32 tx_pn;
+} hpu_ring_geometry_t;
+
+/*
+ * Shared control area, mapped read-only by userspace at HPU_MMAP_CTRL_OFFS.
+ * Indexes are free-running: the buffer they refer to is (index & (pn - 1))
+ */
+typedef struct {
+	u32 rx_pn;
+	u32 rx_ps;
+	u32 rx_stride;
+	u32 rx_head;
+	u32 rx_tail;
+	u32 tx_pn;
+	u32 tx_ps;
+	u32 tx_stride;
+	u32 tx_head;
+	u32 tx_tail;
+	u32 rx_len[];
+} hpu_ring_ctrl_t;
+
+/* TX buffers filled in place through mmap(), to be sent */
+typedef struct {
+	u32 first;
+	u32 count;
+	u32 len;
+	u32 last_len;
+} hpu_tx_ring_submit_t;
+
+/* how write() hands TX data to the DMA */
+typedef struct {
+	u32 max_chain;
+	u32 zerocopy_thr;
+} hpu_tx_dma_cfg_t;
+
+/* when write() kicks the TX DMA */
+typedef struct {
+	u32 max_bufs;
+	u32 max_us;
+} hpu_tx_issue_policy_t;
+
+typedef struct {
+	u64 count;
+	u64 ns_tot;
+	u64 ns_max;
+	u64 issue_count;
+	u64 issue_ns_tot;
+	u64 issue_ns_max;
+} hpu_tx_lat_stats_t;
+
+typedef struct {
+	u32 enable;
+	u32 lookahead_us;
+	u32 max_events;
+} hpu_tx_queue_cfg_t;
+
+/* pattern replayed by the TX DMA; len == 0 stops it */
+typedef struct {
+	u64 data;
+	u32 len;
+	u32 loops;
+} hpu_tx_pattern_t;
+
+typedef struct {
+	u64 loops;
+	u64 underruns;
+} hpu_tx_pattern_stats_t;
+
+/* driver statistics, see HPU_IOCTL_GET_STATS */
+typedef struct {
+	u64 rx_ring_hwm;
+	u64 tx_ring_hwm;
+	u64 read_hist[HPU_STATS_HIST_LEN];
+	u64 rx_fill_hist[HPU_STATS_HIST_LEN];
+	u64 rx_flush_count;
+	u64 rx_flush_ns_tot;
+	u64 rx_flush_ns_max;
+	u64 rx_wakeups;
+	u64 tx_wakeups;
+	u64 rx_submit_errors;
+	u64 tx_submit_errors;
+} hpu_stats_t;
+
+struct hpu_pcpu_stats {
+	hpu_stats_t s;
+	/* the stats have been reset since this epoch */
+	u32 epoch;
+	struct u64_stats_sync syncp;
+};
+
+/* an event in the timed TX queue */
+struct hpu_tx_qev {
+	u64 ts;
+	u32 addr;
+	/* keeps events with the same timestamp in order */
+	u32 seq;
+};
+
 typedef struct {
 	fifo_status_t rx_fifo_status;
 	fifo_status_t tx_fifo_status;
@@ -488,34 +748,69 @@ struct hpu_priv;
 struct hpu_buf {
 	dma_addr_t phys;
 	void *virt;
-	int head_index, tail_index;
+	int tail_index;
 	dma_cookie_t cookie;
+	struct dma_async_tx_descriptor *desc;
 	struct hpu_priv *priv;
 	struct list_head node;
+	/* RX metadata; TX: when the descriptor starting here was submitted */
+	ktime_t time;
+	u32 seq;
+	bool early_tlast;
+	bool gap;
+	/* consumed by a reader sharing the RX ring (see hpu_rx_share_advance()) */
+	bool done;
+	/* timestamps width and epoch of the last event, see hpu_rx_ts_snapshot() */
+	u8 ts_bits;
+	bool ts_valid;
+	u32 ts_epoch;
+	u32 ts_gen;
+	/* TX: ring buffers and bytes sent by the descriptor starting here */
+	int nbufs;
+	size_t nbytes;
 };
 
 struct hpu_dma_pool {
 	spinlock_t spin_lock;
 	struct mutex mutex_lock;
 	struct completion completion;
-	struct dma_pool *dma_pool;
+	/* all the ring buffers are sliced from a single contiguous region */
+	void *virt;
+	dma_addr_t phys;
+	size_t size;
+	int stride;
 	struct hpu_buf *ring;
+	/* TX only: scratch list to chain ring buffers in one descriptor */
+	struct scatterlist *sg;
 	int buf_index;
 	int filled;
+	/* RX only: free-running, lock-free indexes (see hpu_rx_filled()) */
+	unsigned int head;
+	unsigned int tail;
 	int ps;
 	int pn;
 	struct list_head pending_list;
 	struct wait_queue_head wq;
+	struct wait_queue_head poll_wq;
 	struct task_struct *thread;
 	struct mutex list_lock;
 };
 
+/* why RX data has been thrown away, see hpu_rx_loss_stats_t */
+enum hpu_rx_loss {
+	HPU_RX_LOSS_OVERFLOW,
+	HPU_RX_LOSS_DRAIN,
+	HPU_RX_LOSS_FLUSH,
+	HPU_RX_LOSS_NR
+};
+
 enum fifo_status {
 	FIFO_OK,
 	FIFO_DRAINED,
 	FIFO_OVERFLOW,
 	FIFO_OVERFLOW_NOTIFIED,
-	FIFO_STOPPED
+	FIFO_STOPPED,
+	FIFO_RECOVERING
 };
 
 struct hpu_priv {
@@ -526,6 +821,11 @@ struct hpu_priv {
 	int id;
 	unsigned int irq;
 	struct mutex access_lock;
+	/*
+	 * serializes mmap() against the rings swap; access_lock can't be
+	 * used, since ioctl()s fault on user memory while holding it
+	 */
+	struct mutex map_lock;
 	unsigned int hpu_is_opened;
 	void __iomem *reg_base;
 	uint32_t ctrl_reg;
@@ -547,8 +847,61 @@ struct hpu_priv {
 	struct dma_chan *dma_rx_chan;
 	struct dma_chan *dma_tx_chan;
 	struct work_struct rx_housekeeping_work;
+	struct delayed_work rx_coal_work;
 	size_t rx_blocking_threshold;
 	size_t tx_blocking_threshold;
+	/* see HPU_IOCTL_SET_TX_DMA_CFG */
+	u32 tx_max_chain;
+	u32 tx_zc_thr;
+	/*
+	 * write-combining: bytes in the current TX buffer, that is taken
+	 * but not sent yet, and how long it can wait for more data
+	 */
+	u32 tx_wc_us;
+	size_t tx_wc_len;
+	struct hrtimer tx_wc_timer;
+	struct work_struct tx_wc_work;
+	/* oldest TX descriptor not issued yet, zero if none */
+	ktime_t tx_unissued_time;
+	hpu_tx_lat_stats_t tx_lat_stats;
+	/* TX completion notification */
+	u64 tx_bytes_done;
+	struct eventfd_ctx *tx_eventfd;
+	/*
+	 * timed TX queue, a min-heap on the events time; the look-ahead window
+	 * and the last released event time are in timestamp counter ticks
+	 */
+	struct hpu_tx_qev *tx_queue;
+	struct hpu_tx_qev *tx_queue_batch;
+	u32 *tx_queue_stage;
+	u32 tx_queue_size;
+	u32 tx_queue_len;
+	u32 tx_queue_seq;
+	u64 tx_queue_ahead;
+	u64 tx_queue_last;
+	bool tx_queue_stalled;
+	struct hrtimer tx_queue_timer;
+	struct work_struct tx_queue_work;
+	struct wait_queue_head tx_queue_wq;
+	/*
+	 * TX pattern playback: while it's on the whole TX ring belongs to it;
+	 * loops are counted (and re-armed) by the DMA callback, under the TX
+	 * spinlock
+	 */
+	bool tx_pattern_on;
+	bool tx_pattern_stopping;
+	int tx_pattern_nbufs;
+	size_t tx_pattern_len;
+	u32 tx_pattern_loops;
+	u64 tx_pattern_queued;
+	int tx_pattern_inflight;
+	int tx_pattern_depth;
+	dma_cookie_t tx_pattern_cookie;
+	hpu_tx_pattern_stats_t tx_pattern_stats;
+	struct work_struct tx_pattern_work;
+	/* see hpu_stats_begin() */
+	struct hpu_pcpu_stats __percpu *stats;
+	atomic_t stats_epoch;
 	enum fifo_status rx_fifo_status;
 	unsigned long cnt_pktloss;
 	unsigned long pkt_txed;
@@ -556,17 +909,92 @@ struct hpu_priv {
 	unsigned long pkt_rxed;
 	unsigned long byte_rxed;
 	unsigned long early_tlast;
-	int axis_lat;
+	unsigned long axis_lat_us;
+	bool rx_coal_enable;
+	u32 rx_coal_min_us;
+	u32 rx_coal_max_us;
+	unsigned long rx_coal_last_pkt;
+	unsigned long rx_coal_last_early;
+	u32 rx_busy_poll_us;
+	ktime_t rx_wake_time;
+	hpu_rx_wakeup_stats_t rx_wakeup_stats;
+	u32 rx_seq;
+	bool rx_overflow_recovery;
+	bool rx_gap_pending;
+	u16 rx_gap_tlast;
+	unsigned long rx_overflows;
+	u64 rx_fifo_overflows;
+	/* produced is updated by the DMA callback, the others with RX lock held */
+	struct u64_stats_sync rx_bytes_syncp;
+	u64 rx_bytes_produced;
+	u64 rx_bytes_delivered;
+	u64 rx_bytes_lost[HPU_RX_LOSS_NR];
+	bool rx_loss_overflow;
 	unsigned int rx_tlast_count;
 	unsigned int rx_data_count;
+	struct list_head rx_readers;
+	unsigned int rx_nreaders;
+	u32 rx_max_lag;
+	/* readers sharing out the RX buffers among them */
+	unsigned int rx_share_nr;
+	unsigned int rx_share_claim;
+	unsigned int rx_share_done;
+	u32 rx_share_gap;
+	/* timestamp wraps, tracked for the readers unwrapping timestamps */
+	unsigned int rx_unwrap_nr;
+	u32 rx_wraps;
+	ktime_t rx_wrap_time;
+	u32 rx_ts_gen;
+	hpu_ring_ctrl_t *ring_ctrl;
+	atomic_t rx_ring_mapped;
+	atomic_t tx_ring_mapped;
+	atomic_t ctrl_mapped;
 
 	bool thread_exit;
 	bool can_disable_ts;
 	bool tx_ts_disable;
 	bool rx_ts_disable;
+	bool rx_desc_reuse;
 	u32 can_loop;
 };
 
+/* per open file state: each file reads the RX ring with its own cursor */
+struct hpu_file {
+	struct hpu_priv *priv;
+	struct list_head node;
+	/* next RX buffer to read (free-running) and how much of it has been read */
+	unsigned int rx_cursor;
+	int rx_offs;
+	bool rx_meta;
+	bool rx_meta_sent;
+	u32 rx_meta_gap;
+	/* data has been skipped because this reader was lagging too much */
+	bool rx_overrun;
+	/*
+	 * this reader shares the RX buffers with the others doing the same;
+	 * buffers got by HPU_IOCTL_RX_RING_SYNC start from rx_cursor
+	 */
+	bool rx_share;
+	unsigned int rx_claimed;
+	/* RX stream format, and timestamps unwrapping state for converted ones */
+	hpu_rx_format_t rx_format;
+	/* sources of the RX events this reader gets (HPU_RX_SRC_xxx) */
+	u32 rx_src_mask;
+	/* the current RX buffer, as converted by hpu_rx_stage() */
+	bool rx_staged;
+	void *rx_stage;
+	size_t rx_stage_size;
+	size_t rx_stage_len;
+	bool rx_ts_valid;
+	u32 rx_ts_gen;
+	u32 rx_ts_epoch;
+	u32 rx_ts_last;
+	atomic_t rx_ring_mapped;
+	/* see HPU_IOCTL_SET_TX_ISSUE_POLICY */
+	u32 tx_issue_bufs;
+	u32 tx_issue_us;
+};
+
 
 /* *** FUNCTION NOW PRESENT IN KERNEL MAINLINE *** 
 
@@ -627,6 +1055,9 @@ static inline void dma_free_noncoherent(struct device *dev, size_t size, void *v
 #define HPU_DEBUGFS_ULONG(priv, x) debugfs_create_ulong(__stringify(x), 0444, \
 				   priv->debugfsdir, &priv->x);
 
+#define HPU_DEBUGFS_U64(priv, name, x) debugfs_create_u64(name, 0444, \
+				   priv->debugfsdir, &priv->x);
+
 static struct dentry *hpu_debugfsdir = NULL;
 static struct class *hpu_class = NULL;
 static dev_t hpu_devt;
@@ -640,6 +1071,8 @@ static void hpu_dma_free_pool(struct hpu_priv *priv, struct hpu_dma_pool *hpu_po
 	enum dma_data_direction dir);
 static void hpu_do_set_axis_lat(struct hpu_priv *priv);
 static void _hpu_do_set_axis_lat(struct hpu_priv *priv);
+static void hpu_rx_resume(struct hpu_priv *priv);
+static int hpu_tx_wait_idle(struct hpu_priv *priv);
 
 static void hpu_reg_write(struct hpu_priv *priv, u32 val, int offs)
 {
@@ -671,163 +1104,761 @@ static void hpu_clk_disable(struct hpu_priv *priv)
 		clk_disable_unprepare(priv->clk);
 }
 
+/*
+ * Driver statistics are per CPU, so that the hot paths update them with no
+ * locks nor atomics. They are updated only in process and softirq context,
+ * with BHs disabled so that the two never interleave on the same CPU.
+ * Resetting them starts a new epoch: each CPU clears its own copy on its next
+ * update, and the readers skip the copies of the older epochs, so that all
+ * of them restart together.
+ */
+static hpu_stats_t *hpu_stats_begin(struct hpu_priv *priv)
+{
+	struct hpu_pcpu_stats *st;
+	u32 epoch;
+
+	local_bh_disable();
+	epoch = atomic_read(&priv->stats_epoch);
+	st = this_cpu_ptr(priv->stats);
+	u64_stats_update_begin(&st->syncp);
+	if (st->epoch != epoch) {
+		memset(&st->s, 0, sizeof(st->s));
+		st->epoch = epoch;
+	}
+
+	return &st->s;
+}
+
+static void hpu_stats_end(struct hpu_priv *priv)
+{
+	u64_stats_update_end(&this_cpu_ptr(priv->stats)->syncp);
+	local_bh_enable();
+}
+
+static void hpu_stats_hist(u64 *hist, u64 val)
+{
+	hist[min_t(int, fls64(val), HPU_STATS_HIST_LEN - 1)]++;
+}
+
+/* Sum up the statistics of all the CPUs */
+static void hpu_stats_snapshot(struct hpu_priv *priv, hpu_stats_t *stats)
+{
+	u32 epoch = atomic_read(&priv->stats_epoch);
+	struct hpu_pcpu_stats *st;
+	unsigned int start;
+	hpu_stats_t s;
+	bool stale;
+	int cpu, i;
+
+	memset(stats, 0, sizeof(*stats));
+	for_each_possible_cpu(cpu) {
+		st = per_cpu_ptr(priv->stats, cpu);
+		do {
+			start = u64_stats_fetch_begin(&st->syncp);
+			stale = (st->epoch != epoch);
+			s = st->s;
+		} while (u64_stats_fetch_retry(&st->syncp, start));
+		if (stale)
+			continue;
+
+		stats->rx_ring_hwm = max(stats->rx_ring_hwm, s.rx_ring_hwm);
+		stats->tx_ring_hwm = max(stats->tx_ring_hwm, s.tx_ring_hwm);
+		for (i = 0; i < HPU_STATS_HIST_LEN; i++) {
+			stats->read_hist[i] += s.read_hist[i];
+			stats->rx_fill_hist[i] += s.rx_fill_hist[i];
+		}
+		stats->rx_flush_count += s.rx_flush_count;
+		stats->rx_flush_ns_tot += s.rx_flush_ns_tot;
+		stats->rx_flush_ns_max = max(stats->rx_flush_ns_max,
+					     s.rx_flush_ns_max);
+		stats->rx_wakeups += s.rx_wakeups;
+		stats->tx_wakeups += s.tx_wakeups;
+		stats->rx_submit_errors += s.rx_submit_errors;
+		stats->tx_submit_errors += s.tx_submit_errors;
+	}
+}
+
+static void hpu_stats_reset(struct hpu_priv *priv)
+{
+	atomic_inc(&priv->stats_epoch);
+}
+
+static int hpu_stats_show(struct seq_file *m, void *v)
+{
+	struct hpu_priv *priv = m->private;
+	hpu_stats_t *stats;
+	int i;
+
+	stats = kmalloc(sizeof(*stats), GFP_KERNEL);
+	if (!stats)
+		return -ENOMEM;
+	hpu_stats_snapshot(priv, stats);
+
+	seq_printf(m, "rx_ring_hwm %llu\n", stats->rx_ring_hwm);
+	seq_printf(m, "tx_ring_hwm %llu\n", stats->tx_ring_hwm);
+	seq_puts(m, "read_hist");
+	for (i = 0; i < HPU_STATS_HIST_LEN; i++)
+		seq_printf(m, " %llu", stats->read_hist[i]);
+	seq_puts(m, "\nrx_fill_hist");
+	for (i = 0; i < HPU_STATS_HIST_LEN; i++)
+		seq_printf(m, " %llu", stats->rx_fill_hist[i]);
+	seq_printf(m, "\nrx_flush_count %llu\n", stats->rx_flush_count);
+	seq_printf(m, "rx_flush_ns_tot %llu\n", stats->rx_flush_ns_tot);
+	seq_printf(m, "rx_flush_ns_max %llu\n", stats->rx_flush_ns_max);
+	seq_printf(m, "rx_wakeups %llu\n", stats->rx_wakeups);
+	seq_printf(m, "tx_wakeups %llu\n", stats->tx_wakeups);
+	seq_printf(m, "rx_submit_errors %llu\n", stats->rx_submit_errors);
+	seq_printf(m, "tx_submit_errors %llu\n", stats->tx_submit_errors);
+	kfree(stats);
+
+	return 0;
+}
+
+static int hpu_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, hpu_stats_show, inode->i_private);
+}
+
+/* writing anything resets the statistics */
+static ssize_t hpu_stats_write(struct file *file, const char __user *buf,
+			       size_t len, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+
+	hpu_stats_reset(m->private);
+
+	return len;
+}
+
+static const struct file_operations hpu_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = hpu_stats_open,
+	.read = seq_read,
+	.write = hpu_stats_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int hpu_get_stats(struct hpu_priv *priv, hpu_stats_t __user *arg)
+{
+	hpu_stats_t *stats;
+	int ret = 0;
+
+	stats = kmalloc(sizeof(*stats), GFP_KERNEL);
+	if (!stats)
+		return -ENOMEM;
+
+	hpu_stats_snapshot(priv, stats);
+	if (copy_to_user(arg, stats, sizeof(*stats)))
+		ret = -EFAULT;
+	kfree(stats);
+
+	return ret;
+}
+
+/* Must be called with TX spinlock held */
+static void hpu_tx_notify(struct hpu_priv *priv)
+{
+	if (!priv->tx_eventfd)
+		return;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,8,0)
+	eventfd_signal(priv->tx_eventfd, 1);
+#else
+	eventfd_signal(priv->tx_eventfd);
+#endif
+}
+
 static void hpu_tx_dma_callback(void *_buffer)
 {
 	struct hpu_buf *buffer = _buffer;
 	struct hpu_priv *priv = buffer->priv;
+	struct hpu_dma_pool *pool = &priv->dma_tx_pool;
+	int n = buffer->nbufs;
+	u64 ns;
+#ifdef HPU_DMA_STREAMING
+	int i, index = buffer - pool->ring;
+
+	for (i = 0; i < n; i++)
+		dma_sync_single_for_cpu(&priv->pdev->dev,
+					pool->ring[(index + i) & (pool->pn - 1)].phys,
+					pool->ps, DMA_TO_DEVICE);
+#endif
+
+	ns = ktime_to_ns(ktime_sub(ktime_get(), buffer->time));
 
 	/* mark as spare */
-#ifdef HPU_DMA_STREAMING
-	dma_sync_single_for_cpu(&priv->pdev->dev, buffer->phys,
-				priv->dma_tx_pool.ps,
-				DMA_TO_DEVICE);
+	spin_lock(&pool->spin_lock);
+	priv->tx_lat_stats.count++;
+	priv->tx_lat_stats.ns_tot += ns;
+	priv->tx_lat_stats.ns_max = max(priv->tx_lat_stats.ns_max, ns);
+	priv->tx_bytes_done += buffer->nbytes;
+	pool->filled -= n;
+	/* TX buffers complete in order */
+	smp_store_release(&priv->ring_ctrl->tx_tail, priv->ring_ctrl->tx_tail + n);
+	complete(&pool->completion);
+	/* ring was full. wake poll()ers, if any.. */
+	if (pool->filled + n == pool->pn) {
+		wake_up_interruptible(&pool->poll_wq);
+		hpu_stats_begin(priv)->tx_wakeups++;
+		hpu_stats_end(priv);
+	}
+	/* the timed TX queue was waiting for room */
+	if (priv->tx_queue_stalled) {
+		priv->tx_queue_stalled = false;
+		queue_work(system_highpri_wq, &priv->tx_queue_work);
+	}
+	hpu_tx_notify(priv);
+	spin_unlock(&pool->spin_lock);
+}
+
+static void hpu_tx_zc_callback(void *done)
+{
+	complete(done);
+}
+
+static void hpu_rx_issue_pending(struct hpu_priv *priv)
+{
+#ifdef HPU_DMA_DEFER_SUBMIT
+	hpu_rx_dma_wake_deferred(priv);
+#else
+	dma_async_issue_pending(priv->dma_rx_chan);
 #endif
-	spin_lock(&priv->dma_tx_pool.spin_lock);
-	priv->dma_tx_pool.filled--;
-	complete(&priv->dma_tx_pool.completion);
-	spin_unlock(&priv->dma_tx_pool.spin_lock);
 }
 
 /*
- * Drain data from RX DMA descriptors that has been already completed.
+ * The RX ring is a single-producer/single-consumer ring: the DMA callback is
+ * the only one that advances the head index, and the consumer (that is
+ * always serialized by the RX mutex) is the only one that advances the tail
+ * index. Buffers from tail to head are filled with data.
+ * When the device is opened more than once, each reader has its own cursor
+ * and the tail index follows the slowest one (see hpu_rx_readers_release()).
+ *
+ * The acquire on the head index pairs with the release in the DMA callback,
+ * so that buffer content and length are visible to the consumer.
+ */
+static unsigned int hpu_rx_filled(struct hpu_priv *priv)
+{
+	return smp_load_acquire(&priv->dma_rx_pool.head) -
+		READ_ONCE(priv->dma_rx_pool.tail);
+}
+
+/*
+ * Give n buffers at the tail of the RX ring back to the DMA, advance the
+ * tail index and issue pending descriptors.
  * Must be called with RX lock held.
  */
-static void hpu_drain_rx_dma(struct hpu_priv *priv)
+static void hpu_rx_release_bufs(struct hpu_priv *priv, unsigned int n)
 {
-	int finished = 0;
+	struct hpu_dma_pool *pool = &priv->dma_rx_pool;
+	unsigned int tail = pool->tail;
+	unsigned int i;
 	__maybe_unused int ret;
 
-	while (1) {
-		spin_lock_bh(&priv->dma_rx_pool.spin_lock);
-		finished = (priv->dma_rx_pool.filled == 0);
-		if (!finished)
-			priv->dma_rx_pool.filled--;
-		spin_unlock_bh(&priv->dma_rx_pool.spin_lock);
-		if (finished)
-			break;
+	/* buffers have been consumed: tell the DMA cb and mmap() users */
+	smp_store_release(&pool->tail, tail + n);
+	smp_store_release(&priv->ring_ctrl->rx_tail, tail + n);
+
 #ifdef HPU_DMA_DEFER_SUBMIT
-		hpu_rx_dma_submit_buffer_deferred(priv,
-						  &priv->dma_rx_pool.ring[priv->dma_rx_pool.buf_index]);
+	mutex_lock(&pool->list_lock);
+	for (i = 0; i < n; i++)
+		list_add_tail(&pool->ring[(tail + i) & (pool->pn - 1)].node,
+			      &pool->pending_list);
+	mutex_unlock(&pool->list_lock);
 #else
-		ret = hpu_rx_dma_submit_buffer(priv, &priv->dma_rx_pool.ring[priv->dma_rx_pool.buf_index]);
+	for (i = 0; i < n; i++) {
+		ret = hpu_rx_dma_submit_buffer(priv,
+				&pool->ring[(tail + i) & (pool->pn - 1)]);
 		if (ret)
-			dev_err(&priv->pdev->dev, "DMA RX submit error %d while housekeeping\n", ret);
+			dev_err(&priv->pdev->dev, "DMA RX submit error %d\n", ret);
+	}
 #endif
-		/* forcefully advance index. 1pkt lost */
-		priv->dma_rx_pool.buf_index =
-			(priv->dma_rx_pool.buf_index + 1) &
-		(priv->dma_rx_pool.pn - 1);
+	hpu_rx_issue_pending(priv);
+}
 
-		BUG_ON(priv->dma_rx_pool.buf_index >= priv->dma_rx_pool.pn);
+/* how many bytes n filled RX buffers starting from index first hold */
+static u64 hpu_rx_bufs_bytes(struct hpu_priv *priv, unsigned int first,
+			     unsigned int n)
+{
+	struct hpu_dma_pool *pool = &priv->dma_rx_pool;
+	u64 bytes = 0;
+	unsigned int i;
 
-		priv->cnt_pktloss++;
-#ifdef HPU_DMA_DEFER_SUBMIT
-		hpu_rx_dma_wake_deferred(priv);
-#else
-		dma_async_issue_pending(priv->dma_rx_chan);
-#endif
-	}
+	for (i = 0; i < n; i++)
+		bytes += pool->ring[(first + i) & (pool->pn - 1)].tail_index;
+
+	return bytes;
 }
 
-static void _hpu_stop_dma_uh(struct hpu_priv *priv)
+/*
+ * Account RX data that has been thrown away; it is charged to the RX FIFO
+ * overflow if we are handling one.
+ */
+static void hpu_rx_account_loss(struct hpu_priv *priv, enum hpu_rx_loss cause,
+				u64 bytes)
 {
-	/* Make the DMA stop ASAP */
-	hpu_reg_write(priv, 1, HPU_TLAST_TIMEOUT);
-
-	priv->ctrl_reg &= ~HPU_CTRL_ENDMA;
-	hpu_reg_write(priv, priv->ctrl_reg, HPU_CTRL_REG);
+	if (priv->rx_loss_overflow)
+		cause = HPU_RX_LOSS_OVERFLOW;
+	priv->rx_bytes_lost[cause] += bytes;
 }
 
-/* must be called with RX lock held */
-static void _hpu_stop_dma_bh(struct hpu_priv *priv)
+/* how many filled RX buffers a reader has not read yet */
+static unsigned int hpu_rx_reader_filled(struct hpu_file *hf)
 {
-	ktime_t time;
+	unsigned int cursor = READ_ONCE(hf->rx_share) ?
+		READ_ONCE(hf->priv->rx_share_claim) : READ_ONCE(hf->rx_cursor);
 
-	BUG_ON(priv->ctrl_reg & HPU_CTRL_ENDMA);
+	return smp_load_acquire(&hf->priv->dma_rx_pool.head) - cursor;
+}
 
-	/*
-	 * Keep on draining RX DMA descriptor to make sure the IP is
-	 * allowed to end up with a TLAST, otherwise it would not
-	 * stop properly - wait for the IP to really stop.
-	 */
-	time = ktime_add_us(ktime_get(), 2000000); /* timeout 2 Sec */
-	while (hpu_reg_read(priv, HPU_CTRL_REG) & HPU_CTRL_DMA_RUNNING) {
-		if (ktime_compare(ktime_get(), time) > 0) {
-			dev_err(&priv->pdev->dev, "Cannot stop IP (DMA running)\n");
-			break;
+static void hpu_rx_reader_reset(struct hpu_file *hf, unsigned int cursor)
+{
+	WRITE_ONCE(hf->rx_cursor, cursor);
+	hf->rx_offs = 0;
+	hf->rx_meta_sent = false;
+	hf->rx_staged = false;
+}
+
+/*
+ * Move the cursor of every reader past the RX buffers that are about to be
+ * dropped, i.e. up to index end. Must be called with RX lock held.
+ */
+static void hpu_rx_readers_drop(struct hpu_priv *priv, unsigned int end)
+{
+	struct hpu_dma_pool *pool = &priv->dma_rx_pool;
+	struct hpu_file *hf;
+
+	list_for_each_entry(hf, &priv->rx_readers, node) {
+		if (hf->rx_share) {
+			/* buffers got through the RX ring mapping are gone */
+			hf->rx_claimed = 0;
+			continue;
 		}
-		hpu_drain_rx_dma(priv);
-		msleep(5);
+		/* a partially read buffer has been delivered in part */
+		priv->rx_bytes_delivered += hf->rx_offs;
+		hf->rx_meta_gap += end - hf->rx_cursor;
+		hpu_rx_reader_reset(hf, end);
+	}
+
+	if (priv->rx_share_nr) {
+		for (; priv->rx_share_done != priv->rx_share_claim;
+		     priv->rx_share_done++)
+			pool->ring[priv->rx_share_done & (pool->pn - 1)].done = false;
+		priv->rx_share_gap += end - priv->rx_share_claim;
+		priv->rx_share_claim = end;
+		priv->rx_share_done = end;
 	}
 }
 
-static void hpu_start_dma(struct hpu_priv *priv)
+/*
+ * Readers sharing the RX buffers can consume them out of order: move on past
+ * the buffers that have been consumed in a row. Readers that are more than
+ * rx_max_lag buffers behind the head index skip the oldest buffers nobody has
+ * got yet. Must be called with RX lock held.
+ */
+static void hpu_rx_share_advance(struct hpu_priv *priv, unsigned int head)
 {
-	unsigned long flags;
+	struct hpu_dma_pool *pool = &priv->dma_rx_pool;
+	unsigned int lag = head - priv->rx_share_claim;
+	struct hpu_buf *buf;
+
+	if (priv->rx_max_lag && lag > priv->rx_max_lag) {
+		lag -= priv->rx_max_lag;
+		hpu_rx_account_loss(priv, HPU_RX_LOSS_DRAIN,
+				    hpu_rx_bufs_bytes(priv, priv->rx_share_claim,
+						      lag));
+		priv->rx_share_gap += lag;
+		for (; lag; lag--) {
+			buf = &pool->ring[priv->rx_share_claim++ & (pool->pn - 1)];
+			buf->done = true;
+		}
+	}
 
-	spin_lock_irqsave(&priv->irq_lock, flags);
-	priv->ctrl_reg |= HPU_CTRL_ENDMA;
+	while (priv->rx_share_done != priv->rx_share_claim) {
+		buf = &pool->ring[priv->rx_share_done & (pool->pn - 1)];
+		if (!buf->done)
+			break;
+		buf->done = false;
+		priv->rx_share_done++;
+	}
+}
 
-	/*
-	 * Restore AXI latency setting. Note that hpu_do_set_axis_lat()
-	 * does not apply the requested latency until the DMAEN bit is set,
-	 * so we set it above.
-	 */
-	_hpu_do_set_axis_lat(priv);
+/*
+ * Give back to the DMA the RX buffers that every reader is done with.
+ * Readers that are more than rx_max_lag buffers behind the head index skip
+ * ahead, so that they don't stall the others, and get an overrun reported.
+ * Must be called with RX lock held.
+ */
+static void hpu_rx_readers_release(struct hpu_priv *priv)
+{
+	struct hpu_dma_pool *pool = &priv->dma_rx_pool;
+	unsigned int head = smp_load_acquire(&pool->head);
+	unsigned int release = head - pool->tail;
+	unsigned int lag, skip;
+	struct hpu_file *hf;
+
+	if (priv->rx_share_nr) {
+		hpu_rx_share_advance(priv, head);
+		release = priv->rx_share_done - pool->tail;
+	}
 
-	hpu_reg_write(priv, priv->ctrl_reg, HPU_CTRL_REG);
-	spin_unlock_irqrestore(&priv->irq_lock, flags);
-}
+	list_for_each_entry(hf, &priv->rx_readers, node) {
+		if (hf->rx_share)
+			continue;
+		lag = head - hf->rx_cursor;
+		if (priv->rx_max_lag && lag > priv->rx_max_lag) {
+			skip = lag - priv->rx_max_lag;
+			/* a partially read buffer has been delivered in part */
+			priv->rx_bytes_delivered += hf->rx_offs;
+			hpu_rx_account_loss(priv, HPU_RX_LOSS_DRAIN,
+					    hpu_rx_bufs_bytes(priv, hf->rx_cursor,
+							      skip) -
+					    hf->rx_offs);
+			hf->rx_meta_gap += skip;
+			hpu_rx_reader_reset(hf, head - priv->rx_max_lag);
+			hf->rx_overrun = true;
+		}
+		release = min(release, hf->rx_cursor - pool->tail);
+	}
 
+	if (release)
+		hpu_rx_release_bufs(priv, release);
+}
 
-/* must be called with RX lock held */
-static void hpu_stop_dma(struct hpu_priv *priv)
+/*
+ * Make a reader share the RX buffers with the other readers doing the same,
+ * starting from the first buffer it has not fully read yet.
+ * Must be called with RX lock held.
+ */
+static void hpu_rx_share_join(struct hpu_file *hf)
 {
-	unsigned long flags;
+	struct hpu_priv *priv = hf->priv;
 
-	spin_lock_irqsave(&priv->irq_lock, flags);
-	_hpu_stop_dma_uh(priv);
-	spin_unlock_irqrestore(&priv->irq_lock, flags);
+	if (hf->rx_share)
+		return;
 
-	_hpu_stop_dma_bh(priv);
+	if (!priv->rx_share_nr) {
+		priv->rx_share_claim = hf->rx_cursor;
+		priv->rx_share_done = hf->rx_cursor;
+		priv->rx_share_gap = 0;
+	}
+	hpu_rx_reader_reset(hf, hf->rx_cursor);
+	hf->rx_claimed = 0;
+	WRITE_ONCE(hf->rx_share, true);
+	priv->rx_share_nr++;
+	hpu_rx_readers_release(priv);
 }
 
 /*
- * Perform a full RX-path flush by draining all data
+ * Make a reader go on on its own, starting from the first buffer that the
+ * readers sharing the RX buffers have not got yet.
  * Must be called with RX lock held.
  */
-static void hpu_flush_rx(struct hpu_priv *priv)
+static void hpu_rx_share_leave(struct hpu_file *hf)
 {
-	u16 rx_IP_tlast_count, rx_SW_tlast_count;
-	u16 rx_IP_data_count, rx_SW_data_count;
-	int ret;
-	unsigned long flags;
+	struct hpu_priv *priv = hf->priv;
+	struct hpu_dma_pool *pool = &priv->dma_rx_pool;
+	unsigned int i;
 
-	/*
-	 * It doesn't matter if the upper half (_hpu_stop_dma_uh) has been
-	 * already called or not.. This way it's always OK.
-	 */
-	hpu_stop_dma(priv);
-	spin_lock_irqsave(&priv->irq_lock, flags);
-	hpu_reg_write(priv,
-		      priv->ctrl_reg | HPU_CTRL_FLUSH_RX_FIFO, HPU_CTRL_REG);
-	spin_unlock_irqrestore(&priv->irq_lock, flags);
-	/*
-	 * We have flushed RX FIFO, so enabling DMA does not cause any effect on
-	 * RX side. But we want to enable it not to block TX for too much time
-	 */
-	hpu_start_dma(priv);
+	if (!hf->rx_share)
+		return;
 
-	while (1) {
-		hpu_drain_rx_dma(priv);
+	for (i = 0; i < hf->rx_claimed; i++)
+		pool->ring[(hf->rx_cursor + i) & (pool->pn - 1)].done = true;
+	hf->rx_claimed = 0;
+	hpu_rx_share_advance(priv, smp_load_acquire(&pool->head));
 
-		rx_IP_tlast_count = hpu_reg_read(priv, HPU_TLAST_COUNT) >> 16;
-		rx_IP_data_count = hpu_reg_read(priv, HPU_DATA_COUNT) >> 16;
+	WRITE_ONCE(hf->rx_share, false);
+	priv->rx_share_nr--;
+	hpu_rx_reader_reset(hf, priv->rx_share_claim);
+	hpu_rx_readers_release(priv);
+}
 
-		spin_lock_bh(&priv->dma_rx_pool.spin_lock);
-		rx_SW_tlast_count = priv->rx_tlast_count;
-		rx_SW_data_count = priv->rx_data_count;
-		spin_unlock_bh(&priv->dma_rx_pool.spin_lock);
+/*
+ * Get ready to sleep waiting for RX data: drain away any completion leftover,
+ * then check again the ring for data.
+ * The barrier pairs with the one in the DMA callback: either we see the new
+ * head index, or the DMA callback sees our tail index and wakes us up.
+ */
+static unsigned int hpu_rx_prepare_wait(struct hpu_priv *priv)
+{
+	try_wait_for_completion(&priv->dma_rx_pool.completion);
+	smp_mb();
+
+	return hpu_rx_filled(priv);
+}
+
+/* whether the RX path can be used without hpu_rx_check_fifo() intervention */
+static bool hpu_rx_fifo_ok(struct hpu_priv *priv)
+{
+	enum fifo_status state = READ_ONCE(priv->rx_fifo_status);
+
+	return state == FIFO_OK || state == FIFO_RECOVERING;
+}
+
+/* Account the time elapsed since the DMA cb found the RX ring empty */
+static void hpu_rx_wakeup_stat(struct hpu_priv *priv, bool sleep)
+{
+	hpu_rx_wakeup_stats_t *stats = &priv->rx_wakeup_stats;
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(),
+				       READ_ONCE(priv->rx_wake_time)));
+
+	if (sleep) {
+		stats->sleep_count++;
+		stats->sleep_ns_tot += ns;
+		stats->sleep_ns_max = max(stats->sleep_ns_max, ns);
+	} else {
+		stats->spin_count++;
+		stats->spin_ns_tot += ns;
+		stats->spin_ns_max = max(stats->spin_ns_max, ns);
+	}
+}
+
+/*
+ * Spin waiting for RX data for up to rx_busy_poll_us, in order to avoid the
+ * scheduler latency of the sleep/wakeup cycle.
+ */
+static unsigned int hpu_rx_busy_poll(struct hpu_priv *priv)
+{
+	unsigned int avail;
+	ktime_t end;
+
+	end = ktime_add_us(ktime_get(), priv->rx_busy_poll_us);
+	do {
+		avail = hpu_rx_filled(priv);
+		if (avail)
+			return avail;
+
+		/* let the caller handle this */
+		if (!hpu_rx_fifo_ok(priv))
+			break;
+
+		if (need_resched() || signal_pending(current))
+			break;
+
+		cpu_relax();
+	} while (ktime_before(ktime_get(), end));
+
+	return 0;
+}
+
+/*
+ * Wait for RX data when there is more than one reader: the RX lock is
+ * released while sleeping, so that the other readers can go on.
+ */
+static int hpu_rx_wait_shared(struct hpu_file *hf)
+{
+	struct hpu_priv *priv = hf->priv;
+	long ret;
+
+	mutex_unlock(&priv->dma_rx_pool.mutex_lock);
+	ret = wait_event_interruptible_timeout(priv->dma_rx_pool.poll_wq,
+					       hpu_rx_reader_filled(hf) ||
+					       READ_ONCE(hf->rx_overrun) ||
+					       !hpu_rx_fifo_ok(priv),
+					       msecs_to_jiffies(rx_to));
+	mutex_lock(&priv->dma_rx_pool.mutex_lock);
+	if (unlikely(ret < 0))
+		return ret;
+
+	if (unlikely(ret == 0)) {
+		dev_err(&priv->pdev->dev, "DMA timed out\n");
+		return -ETIMEDOUT;
+	}
+
+	return hpu_rx_reader_filled(hf);
+}
+
+/*
+ * Wait for the RX ring to get some data, possibly busy-polling first.
+ * Returns the number of buffers available to the reader, zero if the caller
+ * has to check for RX FIFO status and try again, or a negative error.
+ * Must be called with RX lock held.
+ */
+static int hpu_rx_wait(struct hpu_file *hf)
+{
+	struct hpu_priv *priv = hf->priv;
+	unsigned int avail;
+	long ret;
+
+	if (priv->rx_nreaders > 1)
+		return hpu_rx_wait_shared(hf);
+
+	/* a lone reader always has its cursor at the tail index here */
+
+	if (priv->rx_busy_poll_us) {
+		avail = hpu_rx_busy_poll(priv);
+		if (avail) {
+			hpu_rx_wakeup_stat(priv, false);
+			return avail;
+		}
+	}
+
+	avail = hpu_rx_prepare_wait(priv);
+	if (avail)
+		return avail;
+
+	dev_dbg(&priv->pdev->dev, "wait for dma\n");
+	ret = wait_for_completion_killable_timeout(&priv->dma_rx_pool.completion,
+						   msecs_to_jiffies(rx_to));
+	if (unlikely(ret < 0))
+		return ret;
+
+	if (unlikely(ret == 0)) {
+		dev_err(&priv->pdev->dev, "DMA timed out\n");
+		return -ETIMEDOUT;
+	}
+
+	avail = hpu_rx_filled(priv);
+	if (avail)
+		hpu_rx_wakeup_stat(priv, true);
+
+	return avail;
+}
+
+/*
+ * Drain data from RX DMA descriptors that has been already completed.
+ * Must be called with RX lock held.
+ */
+static void hpu_drain_rx_dma(struct hpu_priv *priv)
+{
+	struct hpu_dma_pool *pool = &priv->dma_rx_pool;
+	unsigned int filled;
+	struct hpu_file *hf;
+	int partial;
+
+	while ((filled = hpu_rx_filled(priv))) {
+		/* the first buffer might have been already partially read */
+		partial = 0;
+		list_for_each_entry(hf, &priv->rx_readers, node)
+			if (hf->rx_cursor == pool->tail)
+				partial = max(partial, hf->rx_offs);
+		hpu_rx_account_loss(priv, HPU_RX_LOSS_DRAIN,
+				    hpu_rx_bufs_bytes(priv, pool->tail, filled) -
+				    partial);
+
+		/* forcefully advance index. pkts lost */
+		hpu_rx_readers_drop(priv, pool->tail + filled);
+		hpu_rx_release_bufs(priv, filled);
+		priv->cnt_pktloss += filled;
+	}
+}
+
+static void _hpu_stop_dma_uh(struct hpu_priv *priv)
+{
+	/* Make the DMA stop ASAP */
+	hpu_reg_write(priv, 1, HPU_TLAST_TIMEOUT);
+
+	priv->ctrl_reg &= ~HPU_CTRL_ENDMA;
+	hpu_reg_write(priv, priv->ctrl_reg, HPU_CTRL_REG);
+}
+
+/* must be called with RX lock held */
+static void _hpu_stop_dma_bh(struct hpu_priv *priv)
+{
+	ktime_t time;
+
+	BUG_ON(priv->ctrl_reg & HPU_CTRL_ENDMA);
+
+	/*
+	 * Keep on draining RX DMA descriptor to make sure the IP is
+	 * allowed to end up with a TLAST, otherwise it would not
+	 * stop properly - wait for the IP to really stop.
+	 */
+	time = ktime_add_us(ktime_get(), 2000000); /* timeout 2 Sec */
+	while (hpu_reg_read(priv, HPU_CTRL_REG) & HPU_CTRL_DMA_RUNNING) {
+		if (ktime_compare(ktime_get(), time) > 0) {
+			dev_err(&priv->pdev->dev, "Cannot stop IP (DMA running)\n");
+			break;
+		}
+		hpu_drain_rx_dma(priv);
+		msleep(5);
+	}
+}
+
+static void hpu_start_dma(struct hpu_priv *priv)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&priv->irq_lock, flags);
+	priv->ctrl_reg |= HPU_CTRL_ENDMA;
+
+	/*
+	 * Restore AXI latency setting. Note that hpu_do_set_axis_lat()
+	 * does not apply the requested latency until the DMAEN bit is set,
+	 * so we set it above.
+	 */
+	_hpu_do_set_axis_lat(priv);
+
+	hpu_reg_write(priv, priv->ctrl_reg, HPU_CTRL_REG);
+	spin_unlock_irqrestore(&priv->irq_lock, flags);
+}
+
+
+/* must be called with RX lock held */
+static void hpu_stop_dma(struct hpu_priv *priv)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&priv->irq_lock, flags);
+	_hpu_stop_dma_uh(priv);
+	spin_unlock_irqrestore(&priv->irq_lock, flags);
+
+	_hpu_stop_dma_bh(priv);
+}
+
+/*
+ * Account data that the IP has pushed out of its FIFO (as per HPU_DATA_COUNT)
+ * but that never landed in a RX buffer.
+ */
+static void hpu_rx_account_flush(struct hpu_priv *priv, u16 IP_data_count,
+				 u16 SW_data_count)
+{
+	u16 words = IP_data_count - SW_data_count;
+
+	if (words < 0x8000)
+		hpu_rx_account_loss(priv, HPU_RX_LOSS_FLUSH, words * 4);
+}
+
+/*
+ * Perform a full RX-path flush by draining all data; overflow tells whether
+ * this is done because of a RX FIFO overflow (for loss accounting).
+ * Must be called with RX lock held.
+ */
+static void hpu_flush_rx(struct hpu_priv *priv, bool overflow)
+{
+	u16 rx_IP_tlast_count, rx_SW_tlast_count;
+	u16 rx_IP_data_count, rx_SW_data_count;
+	int ret;
+	unsigned long flags;
+	ktime_t start = ktime_get();
+	hpu_stats_t *st;
+	u64 ns;
+
+	/*
+	 * It doesn't matter if the upper half (_hpu_stop_dma_uh) has been
+	 * already called or not.. This way it's always OK.
+	 */
+	priv->rx_loss_overflow = overflow;
+	hpu_stop_dma(priv);
+	spin_lock_irqsave(&priv->irq_lock, flags);
+	hpu_reg_write(priv,
+		      priv->ctrl_reg | HPU_CTRL_FLUSH_RX_FIFO, HPU_CTRL_REG);
+	spin_unlock_irqrestore(&priv->irq_lock, flags);
+	/*
+	 * We have flushed RX FIFO, so enabling DMA does not cause any effect on
+	 * RX side. But we want to enable it not to block TX for too much time
+	 */
+	hpu_start_dma(priv);
+
+	while (1) {
+		hpu_drain_rx_dma(priv);
+
+		rx_IP_tlast_count = hpu_reg_read(priv, HPU_TLAST_COUNT) >> 16;
+		rx_IP_data_count = hpu_reg_read(priv, HPU_DATA_COUNT) >> 16;
+
+		rx_SW_tlast_count = READ_ONCE(priv->rx_tlast_count);
+		rx_SW_data_count = READ_ONCE(priv->rx_data_count);
 
 		/*
 		 * We check for both TLAST and DATA count:
@@ -835,10 +1866,13 @@ static void hpu_flush_rx(struct hpu_priv *priv)
 		 * the HW guarantees that the last tranfer has been TLASTed
 		 */
 		if (rx_IP_tlast_count == rx_SW_tlast_count) {
-			if (rx_IP_data_count != rx_SW_data_count)
+			if (rx_IP_data_count != rx_SW_data_count) {
 				dev_err(&priv->pdev->dev, "Flush error (%d %d %d %d)\n",
 					rx_IP_tlast_count, rx_SW_tlast_count,
 					rx_IP_data_count, rx_SW_data_count);
+				hpu_rx_account_flush(priv, rx_IP_data_count,
+						     rx_SW_data_count);
+			}
 			break;
 		}
 
@@ -848,9 +1882,83 @@ static void hpu_flush_rx(struct hpu_priv *priv)
 			dev_err(&priv->pdev->dev, "RX DMA timed out while flushing(%d %d %d %d)\n",
 				rx_IP_tlast_count, rx_SW_tlast_count,
 				rx_IP_data_count, rx_SW_data_count);
+			hpu_rx_account_flush(priv, rx_IP_data_count,
+					     rx_SW_data_count);
 			break;
 		}
 	}
+	priv->rx_loss_overflow = false;
+
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	st = hpu_stats_begin(priv);
+	st->rx_flush_count++;
+	st->rx_flush_ns_tot += ns;
+	st->rx_flush_ns_max = max(st->rx_flush_ns_max, ns);
+	hpu_stats_end(priv);
+}
+
+/*
+ * Recover from an RX FIFO overflow dropping only the data that is still in
+ * the HW FIFO: buffers that have been already completed are left in the ring
+ * for the reader, and the first buffer after the restart is marked as
+ * following a gap.
+ * This waits for the IP to stop without holding the RX lock, because the IP
+ * might need the reader to give back some buffer to terminate its last
+ * transfer; if it does not stop anyway, fall back to the full RX flush.
+ */
+static void hpu_rx_recover(struct hpu_priv *priv)
+{
+	unsigned long flags;
+	ktime_t time;
+	bool stopped;
+
+	time = ktime_add_us(ktime_get(), 2000000); /* timeout 2 Sec */
+	while (!(stopped = !(hpu_reg_read(priv, HPU_CTRL_REG) &
+			     HPU_CTRL_DMA_RUNNING))) {
+		if (ktime_compare(ktime_get(), time) > 0)
+			break;
+		msleep(5);
+	}
+
+	mutex_lock(&priv->dma_rx_pool.mutex_lock);
+
+	/* the device has been closed or reconfigured in the meanwhile */
+	if (READ_ONCE(priv->rx_fifo_status) != FIFO_RECOVERING) {
+		mutex_unlock(&priv->dma_rx_pool.mutex_lock);
+		return;
+	}
+
+	if (stopped) {
+		spin_lock_irqsave(&priv->irq_lock, flags);
+		hpu_reg_write(priv,
+			      priv->ctrl_reg | HPU_CTRL_FLUSH_RX_FIFO, HPU_CTRL_REG);
+		spin_unlock_irqrestore(&priv->irq_lock, flags);
+		hpu_start_dma(priv);
+	} else {
+		dev_notice(&priv->pdev->dev,
+			   "IP not stopping on RX overflow, flushing RX ring\n");
+		hpu_flush_rx(priv, true);
+	}
+
+	/*
+	 * The IP is stopped: the next buffer it is going to produce is the
+	 * first one after the gap. The DMA cb recognizes it by TLAST count.
+	 */
+	WRITE_ONCE(priv->rx_gap_tlast, hpu_reg_read(priv, HPU_TLAST_COUNT) >> 16);
+	smp_store_release(&priv->rx_gap_pending, true);
+	priv->rx_overflows++;
+
+	spin_lock_irqsave(&priv->irq_lock, flags);
+	hpu_rx_resume(priv);
+
+	/* Re-enable RX FIFO full interrupt */
+	priv->irq_msk |= HPU_MSK_INT_RXFIFOFULL;
+	hpu_reg_write(priv, priv->irq_msk, HPU_IRQMASK_REG);
+
+	WRITE_ONCE(priv->rx_fifo_status, FIFO_OK);
+	spin_unlock_irqrestore(&priv->irq_lock, flags);
+
+	mutex_unlock(&priv->dma_rx_pool.mutex_lock);
 }
 
 static void hpu_rx_housekeeping(struct work_struct *work)
@@ -860,6 +1968,12 @@ static void hpu_rx_housekeeping(struct work_struct *work)
 	enum fifo_status state;
 
 	dev_dbg(&priv->pdev->dev, "RX housekeeping ..\n");
+
+	if (READ_ONCE(priv->rx_fifo_status) == FIFO_RECOVERING) {
+		hpu_rx_recover(priv);
+		return;
+	}
+
 	mutex_lock(&priv->dma_rx_pool.mutex_lock);
 
 	/* data has been already drained */
@@ -869,7 +1983,7 @@ static void hpu_rx_housekeeping(struct work_struct *work)
 		return;
 	}
 
-	hpu_flush_rx(priv);
+	hpu_flush_rx(priv, true);
 
 	if (state == FIFO_OVERFLOW) {
 		WRITE_ONCE(priv->rx_fifo_status, FIFO_DRAINED);
@@ -885,15 +1999,98 @@ static void hpu_rx_housekeeping(struct work_struct *work)
 		BUG_ON(state != FIFO_OVERFLOW_NOTIFIED);
 		WRITE_ONCE(priv->rx_fifo_status, FIFO_STOPPED);
 	}
+	wake_up_interruptible(&priv->dma_rx_pool.poll_wq);
 	mutex_unlock(&priv->dma_rx_pool.mutex_lock);
 }
 
+static u32 hpu_ts_mask(unsigned int bits)
+{
+	return bits == 32 ? ~0U : BIT(bits) - 1;
+}
+
+/*
+ * How far the timestamp counter has got since the last wrap interrupt, or
+ * range if no wrap has been seen yet (so it can't be a recent one).
+ * Must be called with irq lock held.
+ */
+static u64 hpu_ts_since_wrap(struct hpu_priv *priv, u32 wraps, u64 range)
+{
+	if (wraps != priv->rx_wraps)
+		/* the wrap interrupt is still pending: it has just happened */
+		return 0;
+
+	if (!priv->rx_wrap_time)
+		return range;
+
+	/* the timestamp counter ticks every 8 clock cycles */
+	return div_u64(min_t(u64, ktime_us_delta(ktime_get(), priv->rx_wrap_time),
+			     U32_MAX) * (priv->clk_rate / 8),
+		       USEC_PER_SEC);
+}
+
+/*
+ * Estimate the timestamp counter value now, extended to 64 bits as in
+ * RX_FORMAT_TS64. This is meaningful only once the counter has been cleared
+ * or has wrapped; before, it's as late as it can be.
+ */
+static u64 hpu_ts_now(struct hpu_priv *priv)
+{
+	unsigned int bits = (READ_ONCE(priv->ctrl_reg) & HPU_CTRL_FULLTS) ?
+		32 : 24;
+	u64 range = BIT_ULL(bits);
+	unsigned long flags;
+	u32 wraps;
+	u64 now;
+
+	spin_lock_irqsave(&priv->irq_lock, flags);
+	wraps = hpu_reg_read(priv, HPU_WRAP_REG);
+	now = hpu_ts_since_wrap(priv, wraps, range);
+	spin_unlock_irqrestore(&priv->irq_lock, flags);
+
+	return (u64)wraps * range + min(now, range - 1);
+}
+
+/*
+ * Find out to which epoch (i.e. after how many timestamp wraps) the last
+ * event of a RX buffer just received belongs. The wraps counter might have
+ * been bumped while the event was on its way to memory, so it's not enough
+ * to read it: the time elapsed since the last wrap interrupt tells how far
+ * the timestamp counter has got now, and an event with a timestamp beyond
+ * that (by more than a quarter of the wrap period, to put up with IRQ and
+ * clock inaccuracies) has been tagged before the last wrap.
+ */
+static void hpu_rx_ts_snapshot(struct hpu_priv *priv, struct hpu_buf *buffer,
+			       int len)
+{
+	u64 range = BIT_ULL(buffer->ts_bits);
+	u32 ts = ((u32 *)buffer->virt)[(len / 8 - 1) * 2] &
+		hpu_ts_mask(buffer->ts_bits);
+	unsigned long flags;
+	u32 wraps;
+	u64 now;
+
+	spin_lock_irqsave(&priv->irq_lock, flags);
+	wraps = hpu_reg_read(priv, HPU_WRAP_REG);
+	buffer->ts_gen = priv->rx_ts_gen;
+	now = hpu_ts_since_wrap(priv, wraps, range);
+	spin_unlock_irqrestore(&priv->irq_lock, flags);
+
+	buffer->ts_epoch = wraps;
+	if (wraps && ts >= now + range / 4)
+		buffer->ts_epoch--;
+	buffer->ts_valid = true;
+}
+
 static void hpu_rx_dma_callback(void *_buffer, const struct dmaengine_result *result)
 {
 	u32 word;
+	unsigned int head;
 	struct hpu_buf *buffer = _buffer;
 	struct hpu_priv *priv = buffer->priv;
 	int len, rawlen = priv->dma_rx_pool.ps - result->residue;
+	unsigned int filled;
+	bool woken = false;
+	hpu_stats_t *st;
 
 	dev_dbg(&priv->pdev->dev, "RX DMA cb\n");
 
@@ -902,6 +2099,9 @@ static void hpu_rx_dma_callback(void *_buffer, const struct dmaengine_result *re
 	 * an early TLAST sending also a dummy data, so we need to discard it
 	 */
 	len = rawlen;
+	buffer->time = ktime_get();
+	buffer->seq = priv->rx_seq++;
+	buffer->early_tlast = false;
 #ifdef HPU_DMA_STREAMING
 	dma_sync_single_for_cpu(&priv->pdev->dev, buffer->phys, priv->dma_rx_pool.ps,
 				DMA_FROM_DEVICE);
@@ -916,66 +2116,493 @@ static void hpu_rx_dma_callback(void *_buffer, const struct dmaengine_result *re
 	 */
 	if (len != priv->dma_rx_pool.ps) {
 		priv->early_tlast++;
+		buffer->early_tlast = true;
 		len -= 4;
 		word = ((u32*)buffer->virt)[len / 4];
 		if (unlikely(word != 0xf0cacc1a))
 			dev_err(&priv->pdev->dev, "Got early TLAST, but no magic word\n");
 	} else if (priv->rx_ts_disable) {
 		word = ((u32*)buffer->virt)[len / 4 - 1];
-		if (word == 0xf0cacc1a)
+		if (word == 0xf0cacc1a) {
+			buffer->early_tlast = true;
 			len -= 4;
+		}
 	}
 
 	priv->byte_rxed += len;
 	priv->pkt_rxed++;
+	u64_stats_update_begin(&priv->rx_bytes_syncp);
+	priv->rx_bytes_produced += len;
+	u64_stats_update_end(&priv->rx_bytes_syncp);
+
+	buffer->gap = false;
+	if (smp_load_acquire(&priv->rx_gap_pending) &&
+	    priv->rx_tlast_count == READ_ONCE(priv->rx_gap_tlast)) {
+		buffer->gap = true;
+		WRITE_ONCE(priv->rx_gap_pending, false);
+	}
 
-	spin_lock(&priv->dma_rx_pool.spin_lock);
-	priv->rx_tlast_count = (priv->rx_tlast_count + 1) & 0xffff;
-	priv->rx_data_count = (priv->rx_data_count + rawlen / 4) & 0xffff;
-	priv->dma_rx_pool.filled++;
+	WRITE_ONCE(priv->rx_tlast_count, (priv->rx_tlast_count + 1) & 0xffff);
+	WRITE_ONCE(priv->rx_data_count,
+		   (priv->rx_data_count + rawlen / 4) & 0xffff);
 	buffer->tail_index = len;
+	priv->ring_ctrl->rx_len[buffer - priv->dma_rx_pool.ring] = len;
+
+	buffer->ts_bits = (READ_ONCE(priv->ctrl_reg) & HPU_CTRL_FULLTS) ? 32 : 24;
+	buffer->ts_valid = false;
+	if (READ_ONCE(priv->rx_unwrap_nr) && !priv->rx_ts_disable && len >= 8)
+		hpu_rx_ts_snapshot(priv, buffer, len);
 
-	if (priv->dma_rx_pool.filled == 1) {
+	/*
+	 * The ring was empty: a reader may be waiting for this buffer. Stamp
+	 * the wakeup before the reader can see the buffer (the release below
+	 * orders it), so that a spinning reader doesn't get an older time.
+	 */
+	if (priv->dma_rx_pool.head == READ_ONCE(priv->dma_rx_pool.tail))
+		WRITE_ONCE(priv->rx_wake_time, ktime_get());
+
+	/* publish the buffer to the reader and to mmap() users */
+	head = priv->dma_rx_pool.head + 1;
+	smp_store_release(&priv->dma_rx_pool.head, head);
+	smp_store_release(&priv->ring_ctrl->rx_head, head);
+
+	/* pairs with the barrier in hpu_rx_prepare_wait() */
+	smp_mb();
+	filled = head - READ_ONCE(priv->dma_rx_pool.tail);
+	if (filled == 1) {
 		dev_dbg(&priv->pdev->dev, "RX DMA waking up reader\n");
 		/* ring was empty. wake reader, if any.. */
 		complete(&priv->dma_rx_pool.completion);
+		wake_up_interruptible(&priv->dma_rx_pool.poll_wq);
+		woken = true;
+	} else if (READ_ONCE(priv->rx_nreaders) > 1) {
+		/* the ring wasn't empty, but some reader might be waiting */
+		wake_up_interruptible(&priv->dma_rx_pool.poll_wq);
+		woken = true;
 	}
-	spin_unlock(&priv->dma_rx_pool.spin_lock);
+
+	st = hpu_stats_begin(priv);
+	st->rx_ring_hwm = max_t(u64, st->rx_ring_hwm, filled);
+	hpu_stats_hist(st->rx_fill_hist, len);
+	if (woken)
+		st->rx_wakeups++;
+	hpu_stats_end(priv);
 }
 
-static ssize_t hpu_chardev_write(struct file *fp, const char __user *buf,
-				 size_t lenght, loff_t *offset)
+/* How many TX buffers can be chained in a single DMA descriptor */
+static int hpu_tx_max_chain(struct hpu_priv *priv)
 {
-	struct dma_async_tx_descriptor *dma_desc;
-	struct hpu_buf *dma_buf;
-	dma_cookie_t cookie;
-	size_t copy;
-	int ret;
-	size_t i = 0;
-	int count = 0;
-	struct hpu_priv *priv = fp->private_data;
-
-	/* allow only pairs TS+VAL that is 4+4 bytes */
-	if (lenght % 8)
-		return -EINVAL;
+	int pn = priv->dma_tx_pool.pn;
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(5,0,0)
-	if (!access_ok(VERIFY_WRITE, buf, lenght))
-#else
-	if (!access_ok(buf, lenght))
-#endif
-		return -EFAULT;
+	if (priv->tx_max_chain)
+		return min_t(int, priv->tx_max_chain, pn);
 
-	mutex_lock(&priv->dma_tx_pool.mutex_lock);
-	while (lenght) {
-		copy = min_t(size_t, priv->dma_tx_pool.ps, lenght);
-		dma_buf = &priv->dma_tx_pool.ring[priv->dma_tx_pool.buf_index];
+	/* the DMA is kicked every half ring anyway */
+	return max(pn / 2, 1);
+}
 
-		while (1) {
-			spin_lock_bh(&priv->dma_tx_pool.spin_lock);
+/*
+ * Queue filled TX buffers to the DMA, starting from the current one, with a
+ * single descriptor; they will be sent once the DMA is kicked with
+ * hpu_tx_issue_pending(). All of them carry len bytes, but the last one.
+ * Must be called with TX lock held.
+ */
+static int hpu_tx_submit_bufs(struct hpu_priv *priv, int count,
+			      size_t len, size_t last_len)
+{
+	struct hpu_dma_pool *pool = &priv->dma_tx_pool;
+	struct hpu_buf *dma_buf = &pool->ring[pool->buf_index];
+	struct dma_async_tx_descriptor *dma_desc;
+	struct scatterlist *sg;
+	hpu_stats_t *st;
+	int i;
+
+	if (count == 1) {
+		dma_desc = dmaengine_prep_slave_single(priv->dma_tx_chan,
+						       dma_buf->phys,
+						       last_len,
+						       DMA_MEM_TO_DEV,
+						       DMA_CTRL_ACK |
+						       DMA_PREP_INTERRUPT);
+	} else {
+		/* ring buffers are already mapped: no need for dma_map_sg() */
+		sg_init_table(pool->sg, count);
+		for_each_sg(pool->sg, sg, count, i) {
+			sg_dma_address(sg) =
+				pool->ring[(pool->buf_index + i) & (pool->pn - 1)].phys;
+			sg_dma_len(sg) = (i == count - 1) ? last_len : len;
+		}
+		dma_desc = dmaengine_prep_slave_sg(priv->dma_tx_chan,
+						   pool->sg, count,
+						   DMA_MEM_TO_DEV,
+						   DMA_CTRL_ACK |
+						   DMA_PREP_INTERRUPT);
+	}
+	if (!dma_desc) {
+		hpu_stats_begin(priv)->tx_submit_errors++;
+		hpu_stats_end(priv);
+		return -ENOMEM;
+	}
+
+	dma_buf->nbufs = count;
+	dma_buf->nbytes = (count - 1) * len + last_len;
+	dma_buf->time = ktime_get();
+	if (!priv->tx_unissued_time)
+		priv->tx_unissued_time = dma_buf->time;
+	dma_desc->callback = hpu_tx_dma_callback;
+	dma_desc->callback_param = dma_buf;
+#ifdef HPU_DMA_STREAMING
+	for (i = 0; i < count; i++)
+		dma_sync_single_for_device(&priv->pdev->dev,
+					   pool->ring[(pool->buf_index + i) & (pool->pn - 1)].phys,
+					   pool->ps, DMA_TO_DEVICE);
+#endif
+	dmaengine_submit(dma_desc);
+	priv->pkt_txed += count;
+	priv->byte_txed += dma_buf->nbytes;
+
+	pool->buf_index = (pool->buf_index + count) & (pool->pn - 1);
+	priv->ring_ctrl->tx_head += count;
+
+	st = hpu_stats_begin(priv);
+	st->tx_ring_hwm = max_t(u64, st->tx_ring_hwm, READ_ONCE(pool->filled));
+	hpu_stats_end(priv);
+
+	return 0;
+}
+
+/*
+ * Kick the TX DMA, accounting how long the oldest descriptor has waited.
+ * Must be called with TX lock held.
+ */
+static void hpu_tx_issue_pending(struct hpu_priv *priv)
+{
+	hpu_tx_lat_stats_t *stats = &priv->tx_lat_stats;
+	u64 ns;
+
+	if (priv->tx_unissued_time) {
+		ns = ktime_to_ns(ktime_sub(ktime_get(),
+					   priv->tx_unissued_time));
+		priv->tx_unissued_time = 0;
+		stats->issue_count++;
+		stats->issue_ns_tot += ns;
+		stats->issue_ns_max = max(stats->issue_ns_max, ns);
+	}
+	dma_async_issue_pending(priv->dma_tx_chan);
+}
+
+/*
+ * Stop the TX DMA, dropping whatever is pending, and give back all the TX
+ * buffers.
+ * Must be called with TX lock held.
+ */
+static void hpu_tx_abort(struct hpu_priv *priv)
+{
+	struct hpu_dma_pool *pool = &priv->dma_tx_pool;
+
+	dmaengine_terminate_sync(priv->dma_tx_chan);
+
+	priv->tx_wc_len = 0;
+	priv->tx_unissued_time = 0;
+
+	spin_lock_bh(&pool->spin_lock);
+	pool->filled = 0;
+	smp_store_release(&priv->ring_ctrl->tx_tail, priv->ring_ctrl->tx_head);
+	complete(&pool->completion);
+	wake_up_interruptible(&pool->poll_wq);
+	spin_unlock_bh(&pool->spin_lock);
+}
+
+/*
+ * Send the partially filled TX buffer left by write-combining, if any.
+ * Must be called with TX lock held.
+ */
+static int hpu_tx_wc_flush(struct hpu_priv *priv)
+{
+	struct hpu_dma_pool *pool = &priv->dma_tx_pool;
+	int ret;
+
+	if (!priv->tx_wc_len)
+		return 0;
+
+	/* if it's already firing, it will find nothing to do */
+	hrtimer_try_to_cancel(&priv->tx_wc_timer);
+
+	ret = hpu_tx_submit_bufs(priv, 1, priv->tx_wc_len, priv->tx_wc_len);
+	priv->tx_wc_len = 0;
+	if (ret) {
+		spin_lock_bh(&pool->spin_lock);
+		pool->filled--;
+		spin_unlock_bh(&pool->spin_lock);
+		return ret;
+	}
+	hpu_tx_issue_pending(priv);
+
+	return 0;
+}
+
+static void hpu_tx_wc_work(struct work_struct *work)
+{
+	struct hpu_priv *priv = container_of(work, struct hpu_priv,
+					     tx_wc_work);
+
+	mutex_lock(&priv->dma_tx_pool.mutex_lock);
+	hpu_tx_wc_flush(priv);
+	mutex_unlock(&priv->dma_tx_pool.mutex_lock);
+}
+
+static enum hrtimer_restart hpu_tx_wc_timer(struct hrtimer *timer)
+{
+	struct hpu_priv *priv = container_of(timer, struct hpu_priv,
+					     tx_wc_timer);
+
+	/* submitting needs the TX lock */
+	queue_work(system_highpri_wq, &priv->tx_wc_work);
+
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Send the next chunk of a write() straight from the user pages, without
+ * copying it into the TX ring, and wait for it to be sent, since the pages
+ * are released afterwards. Returns how many bytes have been sent, or 0 if
+ * they can't be sent in place (i.e. they are not aligned to events).
+ * Must be called with TX lock held and the TX ring idle, since on timeout
+ * whatever is pending in the TX DMA is dropped.
+ */
+static ssize_t hpu_tx_write_zc(struct hpu_priv *priv, struct iov_iter *from,
+			       size_t len)
+{
+	struct dma_async_tx_descriptor *dma_desc;
+	struct device *dev = &priv->pdev->dev;
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct sg_table sgt;
+	struct page **pages;
+	ssize_t got, ret;
+	size_t start;
+	int i, nents, npages;
+
+	pages = kmalloc_array(HPU_TX_ZC_MAX_PAGES, sizeof(*pages), GFP_KERNEL);
+	if (!pages)
+		return -ENOMEM;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,0,0)
+	got = iov_iter_get_pages(from, pages, len, HPU_TX_ZC_MAX_PAGES, &start);
+	if (got > 0)
+		iov_iter_advance(from, got);
+#else
+	got = iov_iter_get_pages2(from, pages, len, HPU_TX_ZC_MAX_PAGES, &start);
+#endif
+	if (got <= 0) {
+		kfree(pages);
+		return got ? got : -EFAULT;
+	}
+	npages = DIV_ROUND_UP(start + got, PAGE_SIZE);
+
+	/* an event must not be split across DMA transfers */
+	if (start % 8 || got % 8) {
+		ret = 0;
+		goto put_pages;
+	}
+
+	ret = sg_alloc_table_from_pages(&sgt, pages, npages, start, got,
+					GFP_KERNEL);
+	if (ret)
+		goto put_pages;
+
+	nents = dma_map_sg(dev, sgt.sgl, sgt.orig_nents, DMA_TO_DEVICE);
+	if (!nents) {
+		ret = -ENOMEM;
+		goto free_table;
+	}
+
+	dma_desc = dmaengine_prep_slave_sg(priv->dma_tx_chan, sgt.sgl, nents,
+					   DMA_MEM_TO_DEV,
+					   DMA_CTRL_ACK | DMA_PREP_INTERRUPT);
+	if (!dma_desc) {
+		hpu_stats_begin(priv)->tx_submit_errors++;
+		hpu_stats_end(priv);
+		ret = -ENOMEM;
+		goto unmap;
+	}
+
+	dma_desc->callback = hpu_tx_zc_callback;
+	dma_desc->callback_param = &done;
+	dmaengine_submit(dma_desc);
+	hpu_tx_issue_pending(priv);
+	priv->pkt_txed++;
+	priv->byte_txed += got;
+
+	if (!wait_for_completion_timeout(&done, msecs_to_jiffies(tx_to))) {
+		dev_err(dev, "TX DMA timed out\n");
+		/* make sure the DMA doesn't touch the pages anymore */
+		hpu_tx_abort(priv);
+		ret = -ETIMEDOUT;
+	} else {
+		spin_lock_bh(&priv->dma_tx_pool.spin_lock);
+		priv->tx_bytes_done += got;
+		hpu_tx_notify(priv);
+		spin_unlock_bh(&priv->dma_tx_pool.spin_lock);
+		ret = got;
+	}
+
+unmap:
+	dma_unmap_sg(dev, sgt.sgl, sgt.orig_nents, DMA_TO_DEVICE);
+free_table:
+	sg_free_table(&sgt);
+put_pages:
+	if (ret <= 0)
+		iov_iter_revert(from, got);
+	for (i = 0; i < npages; i++)
+		put_page(pages[i]);
+	kfree(pages);
+
+	return ret;
+}
+
+/*
+ * Send the TX buffers that userspace has filled in place through mmap().
+ * They must be the next ones in the ring, and they must be free.
+ */
+static int hpu_tx_ring_submit(struct hpu_priv *priv, hpu_tx_ring_submit_t *sub)
+{
+	struct hpu_dma_pool *pool = &priv->dma_tx_pool;
+	u32 i, n, last_len;
+	int ret = 0;
+
+	if (!priv->dma_tx_chan)
+		return -ENODEV;
+
+	if (sub->len > pool->ps || sub->last_len > pool->ps ||
+	    sub->len % 8 || sub->last_len % 8 ||
+	    (sub->count > 1 && !sub->len) || (sub->count && !sub->last_len))
+		return -EINVAL;
+
+	if (!sub->count)
+		return 0;
+
+	mutex_lock(&pool->mutex_lock);
+	if (sub->first != priv->ring_ctrl->tx_head) {
+		ret = -EINVAL;
+		goto exit;
+	}
+
+	spin_lock_bh(&pool->spin_lock);
+	if (pool->filled + sub->count > pool->pn) {
+		spin_unlock_bh(&pool->spin_lock);
+		ret = -ENOSPC;
+		goto exit;
+	}
+	pool->filled += sub->count;
+	spin_unlock_bh(&pool->spin_lock);
+
+	for (i = 0; i < sub->count; i += n) {
+		n = min_t(u32, sub->count - i, hpu_tx_max_chain(priv));
+		last_len = (i + n == sub->count) ? sub->last_len : sub->len;
+		ret = hpu_tx_submit_bufs(priv, n, sub->len, last_len);
+		if (ret) {
+			spin_lock_bh(&pool->spin_lock);
+			pool->filled -= sub->count - i;
+			spin_unlock_bh(&pool->spin_lock);
+			break;
+		}
+	}
+	hpu_tx_issue_pending(priv);
+
+exit:
+	mutex_unlock(&pool->mutex_lock);
+	return ret;
+}
+
+/*
+ * Put TX data, that is pairs TS+VAL, into the TX ring and send them.
+ * See HPU_IOCTL_SET_TX_ISSUE_POLICY about max_bufs and max_us.
+ * Must be called with TX lock held.
+ */
+static ssize_t hpu_tx_write(struct hpu_priv *priv, struct iov_iter *from,
+			    u32 max_bufs, u32 max_us, bool nowait)
+{
+	struct hpu_dma_pool *pool = &priv->dma_tx_pool;
+	size_t copy, copied, last;
+	ssize_t sent;
+	int ret;
+	size_t i = 0;
+	int count = 0;
+	int k, n;
+	size_t lenght = iov_iter_count(from);
+	bool zc, fault;
+	int issue_bufs;
+
+	/* by default, the DMA is kicked every half ring */
+	issue_bufs = max_bufs ?
+		min_t(int, max_bufs, pool->pn) : max(pool->pn / 2, 1);
+
+	/* large writes are sent straight from the user pages, that is blocking */
+	zc = !nowait && priv->tx_zc_thr && lenght >= priv->tx_zc_thr &&
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,0,0)
+		iter_is_iovec(from);
+#else
+		user_backed_iter(from);
+#endif
+
+	while (lenght) {
+		if (zc) {
+			/*
+			 * what has been written before goes first, and must be
+			 * out before: a zero-copy timeout aborts the TX DMA
+			 */
+			ret = hpu_tx_wc_flush(priv);
+			if (!ret)
+				ret = hpu_tx_wait_idle(priv);
+			if (ret) {
+				if (!i)
+					i = ret;
+				goto exit;
+			}
+			sent = hpu_tx_write_zc(priv, from, lenght);
+			if (sent < 0) {
+				if (!i)
+					i = sent;
+				goto exit;
+			}
+			/* can't do it in place: fall back to copying */
+			if (!sent)
+				zc = false;
+			i += sent;
+			lenght -= sent;
+			continue;
+		}
+
+		/* append to the TX buffer left partially filled */
+		if (priv->tx_wc_len) {
+			copy = min_t(size_t, pool->ps - priv->tx_wc_len, lenght);
+			if (!copy_from_iter_full(pool->ring[pool->buf_index].virt +
+						 priv->tx_wc_len, copy, from)) {
+				dev_err(&priv->pdev->dev, "failed copying from user\n");
+				if (!i)
+					i = -EFAULT;
+				goto exit;
+			}
+			priv->tx_wc_len += copy;
+			i += copy;
+			lenght -= copy;
+
+			if (priv->tx_wc_len == pool->ps) {
+				ret = hpu_tx_wc_flush(priv);
+				if (ret) {
+					if (!i)
+						i = ret;
+					goto exit;
+				}
+			}
+			continue;
+		}
+
+		while (1) {
+			spin_lock_bh(&pool->spin_lock);
 
-			/* if the buffer is free, then we are OK */
-			if (priv->dma_tx_pool.filled < priv->dma_tx_pool.pn)
+			/* if a buffer is free, then we are OK */
+			if (pool->filled < pool->pn)
 				/* unlock in outer block */
 				break;
 			/*
@@ -983,306 +2610,1861 @@ static ssize_t hpu_chardev_write(struct file *fp, const char __user *buf,
 			 * return now..
 			 */
 			if (i >= priv->tx_blocking_threshold) {
-				spin_unlock_bh(&priv->dma_tx_pool.spin_lock);
+				spin_unlock_bh(&pool->spin_lock);
+				goto exit;
+			}
+
+			if (nowait) {
+				spin_unlock_bh(&pool->spin_lock);
+				if (!i)
+					i = -EAGAIN;
 				goto exit;
 			}
 
 			/* drain away any completion leftover */
-			try_wait_for_completion(&priv->dma_tx_pool.completion);
-			spin_unlock_bh(&priv->dma_tx_pool.spin_lock);
+			try_wait_for_completion(&pool->completion);
+			spin_unlock_bh(&pool->spin_lock);
+
+			/* what is waiting to be issued is going to free room */
+			if (count) {
+				count = 0;
+				hpu_tx_issue_pending(priv);
+			}
 
 			/* wait for more room */
-			ret = wait_for_completion_killable_timeout(&priv->dma_tx_pool.completion,
+			ret = wait_for_completion_killable_timeout(&pool->completion,
 								   msecs_to_jiffies(tx_to));
 			if (unlikely(ret == 0)) {
 				dev_err(&priv->pdev->dev, "TX DMA timed out\n");
-				mutex_unlock(&priv->dma_tx_pool.mutex_lock);
 				return -ETIMEDOUT;
 			} else if (unlikely(ret < 0)) {
-				mutex_unlock(&priv->dma_tx_pool.mutex_lock);
 				return ret;
 			}
 			dev_dbg(&priv->pdev->dev, "resuming TX\n");
 		}
 
-		priv->dma_tx_pool.filled++;
-		spin_unlock_bh(&priv->dma_tx_pool.spin_lock);
+		/* take all the free buffers we need, to chain them */
+		n = min_t(size_t, pool->pn - pool->filled,
+			  DIV_ROUND_UP(lenght, pool->ps));
+		n = min3(n, hpu_tx_max_chain(priv), issue_bufs);
+		pool->filled += n;
+		spin_unlock_bh(&pool->spin_lock);
+
+		copied = 0;
+		copy = 0;
+		for (k = 0; k < n; k++) {
+			copy = min_t(size_t, pool->ps, lenght - copied);
+			if (!copy_from_iter_full(pool->ring[(pool->buf_index + k) &
+							    (pool->pn - 1)].virt,
+						 copy, from))
+				break;
+			copied += copy;
+		}
 
-		if (__copy_from_user(dma_buf->virt, buf + i, copy)) {
+		fault = (k < n);
+		if (fault) {
 			dev_err(&priv->pdev->dev, "failed copying from user\n");
-			mutex_unlock(&priv->dma_tx_pool.mutex_lock);
-			return -EINVAL;
+			spin_lock_bh(&pool->spin_lock);
+			pool->filled -= n - k;
+			spin_unlock_bh(&pool->spin_lock);
+			/* the last copied buffer is a full one */
+			copy = pool->ps;
+			n = k;
 		}
 
-		/* FIXME: shall we use sg ? */
-		dma_desc = dmaengine_prep_slave_single(priv->dma_tx_chan,
-						       dma_buf->phys,
-						       copy,
-						       DMA_MEM_TO_DEV,
-						       DMA_CTRL_ACK |
-						       DMA_PREP_INTERRUPT);
-		if (!dma_desc) {
-			i = -ENOMEM;
+		/* write-combining: keep the last buffer, if not full, for later */
+		if (!fault && priv->tx_wc_us && copy < pool->ps) {
+			n--;
+			last = copy;
+			copy = pool->ps;
+		} else {
+			last = 0;
+		}
+
+		if (n) {
+			ret = hpu_tx_submit_bufs(priv, n, pool->ps, copy);
+			if (ret) {
+				spin_lock_bh(&pool->spin_lock);
+				pool->filled -= n + !!last;
+				spin_unlock_bh(&pool->spin_lock);
+				if (!i)
+					i = ret;
+				goto exit;
+			}
+		}
+
+		if (last) {
+			priv->tx_wc_len = last;
+			hrtimer_start(&priv->tx_wc_timer,
+				      us_to_ktime(priv->tx_wc_us),
+				      HRTIMER_MODE_REL);
+		}
+
+		i += copied;
+		lenght -= copied;
+		count += n;
+
+		if (fault) {
+			if (!i)
+				i = -EFAULT;
 			goto exit;
 		}
 
-		dma_desc->callback = hpu_tx_dma_callback;
-		dma_desc->callback_param = dma_buf;
-#ifdef HPU_DMA_STREAMING
-		dma_sync_single_for_device(&priv->pdev->dev, dma_buf->phys,
-				   priv->dma_tx_pool.ps, DMA_TO_DEVICE);
+		if (count >= issue_bufs ||
+		    (max_us &&
+		     ktime_us_delta(ktime_get(), priv->tx_unissued_time) >=
+		     max_us)) {
+			count = 0;
+			hpu_tx_issue_pending(priv);
+		}
+	}
+exit:
+	if (count)
+		hpu_tx_issue_pending(priv);
+
+	return i;
+}
+
+static bool hpu_tx_qev_before(struct hpu_tx_qev *a, struct hpu_tx_qev *b)
+{
+	return a->ts < b->ts || (a->ts == b->ts && (s32)(a->seq - b->seq) < 0);
+}
+
+static void hpu_tx_queue_push(struct hpu_priv *priv, struct hpu_tx_qev *ev)
+{
+	struct hpu_tx_qev *q = priv->tx_queue;
+	u32 i = priv->tx_queue_len++;
+	u32 parent;
+
+	while (i) {
+		parent = (i - 1) / 2;
+		if (!hpu_tx_qev_before(ev, &q[parent]))
+			break;
+		q[i] = q[parent];
+		i = parent;
+	}
+	q[i] = *ev;
+}
+
+static void hpu_tx_queue_pop(struct hpu_priv *priv, struct hpu_tx_qev *ev)
+{
+	struct hpu_tx_qev *q = priv->tx_queue;
+	u32 n = --priv->tx_queue_len;
+	u32 i = 0, child;
+
+	*ev = q[0];
+
+	/* sift the last event down from the top */
+	while ((child = 2 * i + 1) < n) {
+		if (child + 1 < n && hpu_tx_qev_before(&q[child + 1], &q[child]))
+			child++;
+		if (!hpu_tx_qev_before(&q[child], &q[n]))
+			break;
+		q[i] = q[child];
+		i = child;
+	}
+	q[i] = q[n];
+}
+
+/*
+ * The timestamp the HW gets for a released event: in TIMINGMODE_DELTA it's
+ * the time since the previous released event (or since now, if that one is
+ * in the past already); otherwise it's just cut to 32 bits.
+ */
+static u32 hpu_tx_queue_hw_ts(struct hpu_priv *priv, u32 mode, u64 ts,
+			      u64 now)
+{
+	u64 from;
+
+	if (mode != HPU_TXCTRL_TIMINGMODE_DELTA)
+		return lower_32_bits(ts);
+
+	from = max(priv->tx_queue_last, now);
+	priv->tx_queue_last = max(priv->tx_queue_last, ts);
+
+	return ts > from ? min_t(u64, ts - from, U32_MAX) : 0;
+}
+
+/* Must be called with TX lock held */
+static void hpu_tx_queue_arm(struct hpu_priv *priv)
+{
+	u64 now = hpu_ts_now(priv) + priv->tx_queue_ahead;
+	u64 ts = priv->tx_queue[0].ts;
+	u64 ticks = ts > now ? ts - now : 0;
+
+	/* look again at least once per second, that also follows clock drifts */
+	ticks = min_t(u64, ticks, priv->clk_rate / 8);
+	hrtimer_start(&priv->tx_queue_timer,
+		      ns_to_ktime(div_u64(ticks * 8 * NSEC_PER_SEC,
+					  priv->clk_rate)),
+		      HRTIMER_MODE_REL);
+}
+
+/*
+ * Move the queued TX events that are due within the look-ahead window into
+ * the TX ring, in time order, then arm the timer for the next one. When the
+ * TX ring is full, the TX DMA callback restarts this as soon as there's room.
+ * Must be called with TX lock held.
+ */
+static void hpu_tx_queue_release(struct hpu_priv *priv)
+{
+	struct hpu_tx_qev *batch = priv->tx_queue_batch;
+	u32 *stage = priv->tx_queue_stage;
+	u32 mode = priv->tx_ctrl_reg & HPU_TXCTRL_TIMINGMODE_MASK;
+	struct iov_iter iter;
+	struct kvec kv;
+	bool released = false;
+	u64 now, last;
+	ssize_t sent;
+	int i, n;
+
+	while (priv->tx_queue_len) {
+		now = hpu_ts_now(priv);
+		last = priv->tx_queue_last;
+		for (n = 0; n < HPU_TX_QUEUE_BATCH && priv->tx_queue_len &&
+			     priv->tx_queue[0].ts <= now + priv->tx_queue_ahead;
+		     n++) {
+			hpu_tx_queue_pop(priv, &batch[n]);
+			stage[n * 2] = hpu_tx_queue_hw_ts(priv, mode,
+							  batch[n].ts, now);
+			stage[n * 2 + 1] = batch[n].addr;
+		}
+		if (!n)
+			break;
+
+		kv.iov_base = stage;
+		kv.iov_len = n * 8;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,1,0)
+		iov_iter_kvec(&iter, WRITE, &kv, 1, kv.iov_len);
+#else
+		iov_iter_kvec(&iter, ITER_SOURCE, &kv, 1, kv.iov_len);
 #endif
-		cookie = dmaengine_submit(dma_desc);
-		priv->pkt_txed++;
-		priv->byte_txed += copy;
+		sent = hpu_tx_write(priv, &iter, 0, 0, true);
+		sent = max_t(ssize_t, sent, 0) / 8;
+		if (sent)
+			released = true;
+		if (sent == n)
+			continue;
+
+		/* no room in the TX ring: put back the rest */
+		priv->tx_queue_last = sent ? max(last, batch[sent - 1].ts) : last;
+		for (i = sent; i < n; i++)
+			hpu_tx_queue_push(priv, &batch[i]);
+
+		spin_lock_bh(&priv->dma_tx_pool.spin_lock);
+		priv->tx_queue_stalled = (priv->dma_tx_pool.filled ==
+					  priv->dma_tx_pool.pn);
+		spin_unlock_bh(&priv->dma_tx_pool.spin_lock);
+		if (priv->tx_queue_stalled)
+			break;
+		/* failed for some other reason: just retry later */
+		if (!sent)
+			break;
+	}
 
-		i += copy;
-		lenght -= copy;
+	/* writers and fsync() wait killable, poll()ers interruptible */
+	if (released)
+		wake_up_all(&priv->tx_queue_wq);
 
-		if (count++ > (priv->dma_tx_pool.pn / 2)) {
-			count = 0;
-			dma_async_issue_pending(priv->dma_tx_chan);
+	if (priv->tx_queue_len && !priv->tx_queue_stalled)
+		hpu_tx_queue_arm(priv);
+}
+
+static void hpu_tx_queue_work(struct work_struct *work)
+{
+	struct hpu_priv *priv = container_of(work, struct hpu_priv,
+					     tx_queue_work);
+
+	mutex_lock(&priv->dma_tx_pool.mutex_lock);
+	if (priv->tx_queue)
+		hpu_tx_queue_release(priv);
+	mutex_unlock(&priv->dma_tx_pool.mutex_lock);
+}
+
+static enum hrtimer_restart hpu_tx_queue_timer(struct hrtimer *timer)
+{
+	struct hpu_priv *priv = container_of(timer, struct hpu_priv,
+					     tx_queue_timer);
+
+	/* releasing needs the TX lock */
+	queue_work(system_highpri_wq, &priv->tx_queue_work);
+
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Put the written events, with 64 bits timestamps, in the timed TX queue;
+ * those that are due already go straight to the TX ring.
+ * Must be called with TX lock held, that is released while waiting for room.
+ */
+static ssize_t hpu_tx_queue_write(struct hpu_priv *priv, struct iov_iter *from,
+				  bool nowait)
+{
+	hpu_rx_ts64_event_t ev[16];
+	struct hpu_tx_qev qev;
+	size_t len = iov_iter_count(from);
+	ssize_t done = 0;
+	int i, n, ret;
+
+	if (len % sizeof(hpu_rx_ts64_event_t))
+		return -EINVAL;
+
+	while (len) {
+		if (priv->tx_queue_len == priv->tx_queue_size) {
+			/* send what's due, to make room */
+			hpu_tx_queue_release(priv);
+			if (priv->tx_queue_len < priv->tx_queue_size)
+				continue;
+
+			if (nowait) {
+				ret = -EAGAIN;
+				break;
+			}
+
+			mutex_unlock(&priv->dma_tx_pool.mutex_lock);
+			ret = wait_event_killable(priv->tx_queue_wq,
+						  READ_ONCE(priv->tx_queue_len) <
+						  READ_ONCE(priv->tx_queue_size) ||
+						  !READ_ONCE(priv->tx_queue));
+			mutex_lock(&priv->dma_tx_pool.mutex_lock);
+			if (ret)
+				break;
+			/* the queue has been disabled meanwhile */
+			if (!priv->tx_queue) {
+				ret = -EINVAL;
+				break;
+			}
+			continue;
+		}
+
+		n = min_t(size_t, len / sizeof(hpu_rx_ts64_event_t),
+			  ARRAY_SIZE(ev));
+		n = min_t(u32, n, priv->tx_queue_size - priv->tx_queue_len);
+		if (!copy_from_iter_full(ev, n * sizeof(hpu_rx_ts64_event_t),
+					 from)) {
+			dev_err(&priv->pdev->dev, "failed copying from user\n");
+			ret = -EFAULT;
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			qev.ts = ((u64)ev[i].ts_hi << 32) | ev[i].ts_lo;
+			qev.addr = ev[i].addr;
+			qev.seq = priv->tx_queue_seq++;
+			hpu_tx_queue_push(priv, &qev);
 		}
+		done += n * sizeof(hpu_rx_ts64_event_t);
+		len -= n * sizeof(hpu_rx_ts64_event_t);
+	}
+
+	if (priv->tx_queue)
+		hpu_tx_queue_release(priv);
+
+	return done ? done : ret;
+}
+
+/* Drop the timed TX queue, with whatever is in it. Must be called with TX lock held */
+static void hpu_tx_queue_free(struct hpu_priv *priv)
+{
+	hrtimer_cancel(&priv->tx_queue_timer);
+	kvfree(priv->tx_queue);
+	kfree(priv->tx_queue_batch);
+	kfree(priv->tx_queue_stage);
+	priv->tx_queue = NULL;
+	priv->tx_queue_batch = NULL;
+	priv->tx_queue_stage = NULL;
+	priv->tx_queue_size = 0;
+	priv->tx_queue_len = 0;
+	priv->tx_queue_stalled = false;
+	wake_up_all(&priv->tx_queue_wq);
+}
+
+static int hpu_set_tx_queue(struct hpu_priv *priv, hpu_tx_queue_cfg_t *cfg)
+{
+	u32 size = cfg->max_events ? cfg->max_events : HPU_TX_QUEUE_DEF_EVENTS;
+	struct hpu_tx_qev *queue, *batch;
+	u32 *stage;
+
+	if (!priv->dma_tx_chan)
+		return -ENODEV;
+
+	if (!cfg->enable) {
+		mutex_lock(&priv->dma_tx_pool.mutex_lock);
+		hpu_tx_queue_free(priv);
+		mutex_unlock(&priv->dma_tx_pool.mutex_lock);
+		return 0;
+	}
+
+	if (size > HPU_TX_QUEUE_MAX_EVENTS ||
+	    cfg->lookahead_us > HPU_TX_QUEUE_MAX_AHEAD_US)
+		return -EINVAL;
+
+	/* userspace fills the TX buffers on its own, or they replay a pattern */
+	if (atomic_read(&priv->tx_ring_mapped) ||
+	    READ_ONCE(priv->tx_pattern_on))
+		return -EBUSY;
+
+	mutex_lock(&priv->dma_tx_pool.mutex_lock);
+	priv->tx_queue_ahead = div_u64((u64)cfg->lookahead_us *
+				       (priv->clk_rate / 8), USEC_PER_SEC);
+
+	/* just a new look-ahead window: keep the queued events */
+	if (priv->tx_queue && size == priv->tx_queue_size) {
+		hpu_tx_queue_release(priv);
+		mutex_unlock(&priv->dma_tx_pool.mutex_lock);
+		return 0;
+	}
+	mutex_unlock(&priv->dma_tx_pool.mutex_lock);
+
+	queue = kvmalloc_array(size, sizeof(*queue), GFP_KERNEL);
+	batch = kmalloc_array(HPU_TX_QUEUE_BATCH, sizeof(*batch), GFP_KERNEL);
+	stage = kmalloc_array(HPU_TX_QUEUE_BATCH * 2, sizeof(*stage),
+			      GFP_KERNEL);
+	if (!queue || !batch || !stage) {
+		kvfree(queue);
+		kfree(batch);
+		kfree(stage);
+		return -ENOMEM;
+	}
+
+	mutex_lock(&priv->dma_tx_pool.mutex_lock);
+	hpu_tx_queue_free(priv);
+	priv->tx_queue = queue;
+	priv->tx_queue_batch = batch;
+	priv->tx_queue_stage = stage;
+	priv->tx_queue_size = size;
+	priv->tx_queue_last = 0;
+	mutex_unlock(&priv->dma_tx_pool.mutex_lock);
+
+	return 0;
+}
+
+static ssize_t hpu_chardev_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct file *fp = iocb->ki_filp;
+	struct hpu_file *hf = fp->private_data;
+	struct hpu_priv *priv = hf->priv;
+	bool nowait = (iocb->ki_flags & IOCB_NOWAIT) ||
+		(fp->f_flags & O_NONBLOCK);
+	ssize_t ret;
+
+	/* the TX ring is being filled through mmap() */
+	if (atomic_read(&priv->tx_ring_mapped))
+		return -EBUSY;
+
+	if (nowait) {
+		if (!mutex_trylock(&priv->dma_tx_pool.mutex_lock))
+			return -EAGAIN;
+	} else {
+		mutex_lock(&priv->dma_tx_pool.mutex_lock);
+	}
+
+	if (READ_ONCE(priv->tx_pattern_on)) {
+		/* the TX ring is replaying a pattern */
+		ret = -EBUSY;
+	} else if (priv->tx_queue) {
+		ret = hpu_tx_queue_write(priv, from, nowait);
+	} else if (iov_iter_count(from) % 8) {
+		/* allow only pairs TS+VAL that is 4+4 bytes */
+		ret = -EINVAL;
+	} else {
+		ret = hpu_tx_write(priv, from, hf->tx_issue_bufs,
+				   hf->tx_issue_us, nowait);
+	}
+	mutex_unlock(&priv->dma_tx_pool.mutex_lock);
+
+	return ret;
+}
+
+/*
+ * Wait for all the pending TX buffers to be sent.
+ * Must be called with TX lock held.
+ */
+static int hpu_tx_wait_idle(struct hpu_priv *priv)
+{
+	bool idle;
+	long ret;
+
+	while (1) {
+		spin_lock_bh(&priv->dma_tx_pool.spin_lock);
+		idle = (priv->dma_tx_pool.filled == 0);
+		if (!idle)
+			/* drain away any completion leftover */
+			try_wait_for_completion(&priv->dma_tx_pool.completion);
+		spin_unlock_bh(&priv->dma_tx_pool.spin_lock);
+		if (idle)
+			return 0;
+
+		ret = wait_for_completion_killable_timeout(&priv->dma_tx_pool.completion,
+							   msecs_to_jiffies(tx_to));
+		if (!ret) {
+			dev_err(&priv->pdev->dev, "TX DMA timed out\n");
+			return -ETIMEDOUT;
+		} else if (ret < 0) {
+			return ret;
+		}
+	}
+}
+
+/*
+ * Send whatever has been written and wait for it to leave the DMA, so that
+ * e.g. a test can go on without guessing how long it takes. Events in the
+ * timed TX queue are waited for as they come due, and a TX pattern for its
+ * loops to end.
+ */
+static int hpu_chardev_fsync(struct file *fp, loff_t start, loff_t end,
+			     int datasync)
+{
+	struct hpu_file *hf = fp->private_data;
+	struct hpu_priv *priv = hf->priv;
+	u32 len;
+	long left;
+	int ret;
+
+	mutex_lock(&priv->dma_tx_pool.mutex_lock);
+	/*
+	 * The timed TX queue empties as its events come due; give up if it
+	 * doesn't move for tx_to, as when waiting for the TX DMA.
+	 */
+	while ((len = priv->tx_queue_len)) {
+		mutex_unlock(&priv->dma_tx_pool.mutex_lock);
+		left = wait_event_killable_timeout(priv->tx_queue_wq,
+						   READ_ONCE(priv->tx_queue_len) != len,
+						   msecs_to_jiffies(tx_to));
+		if (!left) {
+			dev_err(&priv->pdev->dev, "TX queue timed out\n");
+			return -ETIMEDOUT;
+		} else if (left < 0) {
+			return left;
+		}
+		mutex_lock(&priv->dma_tx_pool.mutex_lock);
+	}
+	while (READ_ONCE(priv->tx_pattern_on)) {
+		mutex_unlock(&priv->dma_tx_pool.mutex_lock);
+		ret = wait_event_killable(priv->dma_tx_pool.poll_wq,
+					  !READ_ONCE(priv->tx_pattern_on));
+		if (ret)
+			return ret;
+		mutex_lock(&priv->dma_tx_pool.mutex_lock);
+	}
+	ret = hpu_tx_wc_flush(priv);
+	if (!ret)
+		ret = hpu_tx_wait_idle(priv);
+	mutex_unlock(&priv->dma_tx_pool.mutex_lock);
+
+	return ret;
+}
+
+static void hpu_tx_pattern_callback(void *_priv);
+
+/*
+ * Queue one loop of the TX pattern to the DMA, with a single descriptor so
+ * that a loop is either queued whole or not at all.
+ * Must be called with TX spinlock held.
+ */
+static int hpu_tx_pattern_submit(struct hpu_priv *priv)
+{
+	struct hpu_dma_pool *pool = &priv->dma_tx_pool;
+	struct dma_async_tx_descriptor *dma_desc;
+	int nbufs = priv->tx_pattern_nbufs;
+	size_t len = priv->tx_pattern_len;
+	struct scatterlist *sg;
+	hpu_stats_t *st;
+	int i;
+
+	if (nbufs == 1) {
+		dma_desc = dmaengine_prep_slave_single(priv->dma_tx_chan,
+						       pool->ring[0].phys, len,
+						       DMA_MEM_TO_DEV,
+						       DMA_CTRL_ACK |
+						       DMA_PREP_INTERRUPT);
+	} else {
+		sg_init_table(pool->sg, nbufs);
+		for_each_sg(pool->sg, sg, nbufs, i) {
+			sg_dma_address(sg) = pool->ring[i].phys;
+			sg_dma_len(sg) = min_t(size_t, len - i * pool->ps,
+					       pool->ps);
+		}
+		dma_desc = dmaengine_prep_slave_sg(priv->dma_tx_chan,
+						   pool->sg, nbufs,
+						   DMA_MEM_TO_DEV,
+						   DMA_CTRL_ACK |
+						   DMA_PREP_INTERRUPT);
+	}
+	if (!dma_desc) {
+		hpu_stats_begin(priv)->tx_submit_errors++;
+		hpu_stats_end(priv);
+		return -ENOMEM;
+	}
+
+	dma_desc->callback = hpu_tx_pattern_callback;
+	dma_desc->callback_param = priv;
+	priv->tx_pattern_cookie = dmaengine_submit(dma_desc);
+	priv->pkt_txed += nbufs;
+	priv->byte_txed += len;
+	priv->tx_pattern_inflight++;
+	priv->tx_pattern_queued++;
+
+	st = hpu_stats_begin(priv);
+	st->tx_ring_hwm = max_t(u64, st->tx_ring_hwm, pool->pn);
+	hpu_stats_end(priv);
+
+	return 0;
+}
+
+/*
+ * Keep enough loops of the TX pattern queued to the DMA, so that it doesn't
+ * run dry while the callback for the previous ones gets to run.
+ * Must be called with TX spinlock held.
+ */
+static int hpu_tx_pattern_fill(struct hpu_priv *priv)
+{
+	int ret = 0;
+
+	while (!priv->tx_pattern_stopping &&
+	       priv->tx_pattern_inflight < priv->tx_pattern_depth &&
+	       (!priv->tx_pattern_loops ||
+		priv->tx_pattern_queued < priv->tx_pattern_loops)) {
+		ret = hpu_tx_pattern_submit(priv);
+		if (ret)
+			break;
+	}
+	dma_async_issue_pending(priv->dma_tx_chan);
+
+	return ret;
+}
+
+/*
+ * The TX pattern is over: the TX ring is given back.
+ * Must be called with TX spinlock held.
+ */
+static void hpu_tx_pattern_end(struct hpu_priv *priv)
+{
+	struct hpu_dma_pool *pool = &priv->dma_tx_pool;
+
+	priv->tx_pattern_on = false;
+	priv->tx_pattern_inflight = 0;
+	pool->filled = 0;
+	complete(&pool->completion);
+	/* fsync() waits for the end killable */
+	wake_up_all(&pool->poll_wq);
+}
+
+static void hpu_tx_pattern_callback(void *_priv)
+{
+	struct hpu_priv *priv = _priv;
+	struct hpu_dma_pool *pool = &priv->dma_tx_pool;
+
+	spin_lock(&pool->spin_lock);
+	priv->tx_bytes_done += priv->tx_pattern_len;
+	priv->tx_pattern_stats.loops++;
+	priv->tx_pattern_inflight--;
+	hpu_tx_notify(priv);
+
+	if (!priv->tx_pattern_stopping &&
+	    (!priv->tx_pattern_loops ||
+	     priv->tx_pattern_queued < priv->tx_pattern_loops)) {
+		/* the DMA has gone through all the loops it had */
+		if (!priv->tx_pattern_inflight ||
+		    dma_async_is_tx_complete(priv->dma_tx_chan,
+					     priv->tx_pattern_cookie,
+					     NULL, NULL) == DMA_COMPLETE)
+			priv->tx_pattern_stats.underruns++;
+		/* out of descriptors: the next callbacks will retry */
+		if (hpu_tx_pattern_fill(priv) && !priv->tx_pattern_inflight)
+			queue_work(system_highpri_wq, &priv->tx_pattern_work);
+	} else if (!priv->tx_pattern_inflight) {
+		hpu_tx_pattern_end(priv);
+	}
+	spin_unlock(&pool->spin_lock);
+}
+
+/* retry queueing the TX pattern when the DMA callback couldn't */
+static void hpu_tx_pattern_work(struct work_struct *work)
+{
+	struct hpu_priv *priv = container_of(work, struct hpu_priv,
+					     tx_pattern_work);
+	struct hpu_dma_pool *pool = &priv->dma_tx_pool;
+
+	spin_lock_bh(&pool->spin_lock);
+	if (priv->tx_pattern_on && !priv->tx_pattern_inflight &&
+	    hpu_tx_pattern_fill(priv) && !priv->tx_pattern_inflight) {
+		dev_err(&priv->pdev->dev, "failed queueing the TX pattern\n");
+		hpu_tx_pattern_end(priv);
+	}
+	spin_unlock_bh(&pool->spin_lock);
+}
+
+/*
+ * Stop the TX pattern playback, dropping the loops the DMA has not done yet.
+ * Must be called with TX lock held.
+ */
+static void hpu_tx_pattern_stop(struct hpu_priv *priv)
+{
+	struct hpu_dma_pool *pool = &priv->dma_tx_pool;
+
+	spin_lock_bh(&pool->spin_lock);
+	if (!priv->tx_pattern_on) {
+		spin_unlock_bh(&pool->spin_lock);
+		return;
+	}
+	priv->tx_pattern_stopping = true;
+	spin_unlock_bh(&pool->spin_lock);
+
+	dmaengine_terminate_sync(priv->dma_tx_chan);
+	cancel_work_sync(&priv->tx_pattern_work);
+
+	spin_lock_bh(&pool->spin_lock);
+	if (priv->tx_pattern_on)
+		hpu_tx_pattern_end(priv);
+	spin_unlock_bh(&pool->spin_lock);
+}
+
+/*
+ * Load a pattern in the TX ring and let the DMA replay it the given number
+ * of times, or forever if zero, with no further copies nor syscalls.
+ */
+static int hpu_set_tx_pattern(struct hpu_priv *priv, hpu_tx_pattern_t *pat)
+{
+	struct hpu_dma_pool *pool = &priv->dma_tx_pool;
+	const char __user *data = u64_to_user_ptr(pat->data);
+	size_t len = pat->len;
+	size_t copy;
+	int i, ret;
+
+	if (!priv->dma_tx_chan)
+		return -ENODEV;
+
+	mutex_lock(&pool->mutex_lock);
+	hpu_tx_pattern_stop(priv);
+	if (!len) {
+		ret = 0;
+		goto unlock;
+	}
+
+	/* allow only pairs TS+VAL that is 4+4 bytes */
+	if (len % 8 || len > (size_t)pool->pn * pool->ps) {
+		ret = -EINVAL;
+		goto unlock;
+	}
+
+	/* someone else is feeding the TX ring */
+	if (atomic_read(&priv->tx_ring_mapped) || priv->tx_queue) {
+		ret = -EBUSY;
+		goto unlock;
+	}
+
+	/* what has been written before goes first */
+	ret = hpu_tx_wc_flush(priv);
+	if (!ret)
+		ret = hpu_tx_wait_idle(priv);
+	if (ret)
+		goto unlock;
+
+	for (i = 0; len; i++) {
+		copy = min_t(size_t, len, pool->ps);
+		if (copy_from_user(pool->ring[i].virt, data, copy)) {
+			ret = -EFAULT;
+			goto unlock;
+		}
+#ifdef HPU_DMA_STREAMING
+		dma_sync_single_for_device(&priv->pdev->dev, pool->ring[i].phys,
+					   pool->ps, DMA_TO_DEVICE);
+#endif
+		data += copy;
+		len -= copy;
+	}
+
+	spin_lock_bh(&pool->spin_lock);
+	/* the whole TX ring is taken, as far as write() and poll() know */
+	pool->filled = pool->pn;
+	priv->tx_pattern_on = true;
+	priv->tx_pattern_stopping = false;
+	priv->tx_pattern_nbufs = i;
+	priv->tx_pattern_len = pat->len;
+	priv->tx_pattern_loops = pat->loops;
+	priv->tx_pattern_queued = 0;
+	priv->tx_pattern_inflight = 0;
+	/* short patterns need more loops queued to cover the callback latency */
+	priv->tx_pattern_depth = max(HPU_TX_PATTERN_MIN_DEPTH, pool->pn / i);
+	memset(&priv->tx_pattern_stats, 0, sizeof(priv->tx_pattern_stats));
+	ret = hpu_tx_pattern_fill(priv);
+	if (ret && !priv->tx_pattern_inflight)
+		hpu_tx_pattern_end(priv);
+	else
+		ret = 0;
+	spin_unlock_bh(&pool->spin_lock);
+
+unlock:
+	mutex_unlock(&pool->mutex_lock);
+
+	return ret;
+}
+
+static int hpu_set_tx_eventfd(struct hpu_priv *priv, int fd)
+{
+	struct eventfd_ctx *ctx = NULL, *old;
+
+	if (!priv->dma_tx_chan)
+		return -ENODEV;
+
+	if (fd >= 0) {
+		ctx = eventfd_ctx_fdget(fd);
+		if (IS_ERR(ctx))
+			return PTR_ERR(ctx);
+	}
+
+	spin_lock_bh(&priv->dma_tx_pool.spin_lock);
+	old = priv->tx_eventfd;
+	priv->tx_eventfd = ctx;
+	spin_unlock_bh(&priv->dma_tx_pool.spin_lock);
+
+	if (old)
+		eventfd_ctx_put(old);
+
+	return 0;
+}
+
+static int hpu_set_tx_wc(struct hpu_priv *priv, unsigned int us)
+{
+	int ret = 0;
+
+	if (!priv->dma_tx_chan)
+		return -ENODEV;
+
+	if (us > HPU_TX_WC_MAX_US)
+		return -EINVAL;
+
+	/* userspace fills the TX buffers on its own */
+	if (us && atomic_read(&priv->tx_ring_mapped))
+		return -EBUSY;
+
+	mutex_lock(&priv->dma_tx_pool.mutex_lock);
+	priv->tx_wc_us = us;
+	if (!us)
+		ret = hpu_tx_wc_flush(priv);
+	mutex_unlock(&priv->dma_tx_pool.mutex_lock);
+
+	return ret;
+}
+
+/* those three func are called with irq lock held */
+static void hpu_rx_suspend(struct hpu_priv *priv)
+{
+	priv->rx_suspended = 1;
+	hpu_reg_write(priv, 0, HPU_RXCTRL_REG);
+	hpu_reg_write(priv, 0, HPU_AUX_RXCTRL_REG);
+	priv->ctrl_reg &= ~HPU_CTRL_LOOP_LNEAR;
+	hpu_reg_write(priv, priv->ctrl_reg , HPU_CTRL_REG);
+}
+
+static void hpu_rx_resume(struct hpu_priv *priv)
+{
+	priv->rx_suspended = 0;
+	hpu_reg_write(priv, priv->rx_ctrl_reg, HPU_RXCTRL_REG);
+	hpu_reg_write(priv, priv->rx_aux_ctrl_reg, HPU_AUX_RXCTRL_REG);
+	priv->ctrl_reg |= priv->loop_bits;
+	hpu_reg_write(priv, priv->ctrl_reg, HPU_CTRL_REG);
+}
+
+static int hpu_rx_is_suspended(struct hpu_priv *priv)
+{
+	return priv->rx_suspended;
+}
+
+/*
+ * Handle any pending RX FIFO overflow condition. Returns -ENOMEM when the
+ * overflow has to be reported to the caller, -EAGAIN when the FIFO still
+ * has to be drained but the caller can't sleep: in this case the drain is
+ * left to the housekeeping work, that wakes up pollers when done.
+ * Must be called with RX lock held.
+ */
+static int hpu_rx_check_fifo(struct hpu_priv *priv, bool nowait)
+{
+	unsigned long flags;
+
+	switch(READ_ONCE(priv->rx_fifo_status)) {
+	case FIFO_OK:
+	case FIFO_RECOVERING:
+		/* buffers completed before the overflow can be still read */
+		break;
+
+	case FIFO_OVERFLOW:
+		/*
+		 * FIFO-full, nobody cared yet. Bail out failing
+		 * and mark as 'notified'.
+		 */
+		WRITE_ONCE(priv->rx_fifo_status, FIFO_OVERFLOW_NOTIFIED);
+		return -ENOMEM;
+
+	case FIFO_DRAINED:
+		/*
+		 * FIFO-full, already drained. Bail out failing
+		 * but next time we'll be OK.
+		 */
+		WRITE_ONCE(priv->rx_fifo_status, FIFO_STOPPED);
+		return -ENOMEM;
+
+	case FIFO_OVERFLOW_NOTIFIED:
+		/*
+		 * FIFO-full, we had already notified this, but
+		 * no-one has drained the fifo yet. Do it now,
+		 * then we are OK and we can go on without fail.
+		 */
+		if (nowait) {
+			schedule_work(&priv->rx_housekeeping_work);
+			return -EAGAIN;
+		}
+		hpu_flush_rx(priv, true);
+
+		/* fall-through */
+	case FIFO_STOPPED:
+		/*
+		 * An overflow has been fixed. We have to
+		 * restart the RX machanism, then we can go on.
+		 */
+		spin_lock_irqsave(&priv->irq_lock, flags);
+		hpu_rx_resume(priv);
+
+		/* Re-enable RX FIFO full interrupt */
+		priv->irq_msk |= HPU_MSK_INT_RXFIFOFULL;
+		hpu_reg_write(priv, priv->irq_msk, HPU_IRQMASK_REG);
+
+		WRITE_ONCE(priv->rx_fifo_status, FIFO_OK);
+		spin_unlock_irqrestore(&priv->irq_lock, flags);
+		break;
+	}
+
+	return 0;
+}
+
+/* fill the RX metadata header for a buffer */
+static void hpu_rx_fill_meta(struct hpu_buf *item, hpu_rx_meta_t *meta,
+			     u32 len, u32 gap)
+{
+	meta->time_ns = ktime_to_ns(item->time);
+	meta->seq = item->seq;
+	meta->len = len;
+	meta->flags = item->early_tlast ? HPU_RX_META_EARLY_TLAST : 0;
+	if (item->gap)
+		meta->flags |= HPU_RX_META_GAP;
+	meta->gap = gap;
+}
+
+/*
+ * Whether RX buffers have to be converted whole, by hpu_rx_stage(), before
+ * being copied out: the converted size can't be told otherwise.
+ */
+static bool hpu_rx_needs_stage(struct hpu_file *hf)
+{
+	return hf->rx_format == RX_FORMAT_DELTA ||
+		hf->rx_src_mask != HPU_RX_SRC_ALL;
+}
+
+static bool hpu_rx_src_match(struct hpu_file *hf, u32 addr)
+{
+	return hf->rx_src_mask &
+		BIT((addr & HPU_RX_SRC_MSK) >> HPU_RX_SRC_SHIFT);
+}
+
+/* how many bytes a RX buffer chunk grows to once converted to the reader format */
+static size_t hpu_rx_out_len(struct hpu_file *hf, size_t len)
+{
+	if (hf->rx_format == RX_FORMAT_TS64 && !hpu_rx_needs_stage(hf))
+		return len / 8 * sizeof(hpu_rx_ts64_event_t);
+	return len;
+}
+
+/*
+ * Get ready to unwrap the timestamps of a RX buffer: find out the epoch of
+ * its first event. Going on from the last event read is right as long as
+ * the timestamp has not wrapped more than once in between, which can't be
+ * told while the events are sparse; the epoch worked out when the buffer
+ * has been received (counting back the wraps within the buffer itself) is
+ * right in any case, so it wins, but the timestamps never go backwards.
+ */
+static void hpu_rx_ts64_start(struct hpu_file *hf, struct hpu_buf *item)
+{
+	u32 *data = item->virt;
+	u32 mask = hpu_ts_mask(item->ts_bits);
+	unsigned int i, n = item->tail_index / 8;
+	u32 epoch, snap, ts, last;
+	bool cont;
+
+	if (!n)
+		return;
+
+	cont = hf->rx_ts_valid && hf->rx_ts_gen == item->ts_gen;
+	last = data[0] & mask;
+	epoch = hf->rx_ts_epoch;
+	if (cont && last < hf->rx_ts_last)
+		epoch++;
+
+	if (item->ts_valid) {
+		snap = item->ts_epoch;
+		for (i = 1; i < n; i++) {
+			ts = data[i * 2] & mask;
+			if (ts < last)
+				snap--;
+			last = ts;
+		}
+		if (!cont || snap > epoch)
+			epoch = snap;
+	}
+
+	hf->rx_ts_epoch = epoch;
+	hf->rx_ts_last = data[0] & mask;
+	hf->rx_ts_gen = item->ts_gen;
+	hf->rx_ts_valid = true;
+}
+
+static inline u64 hpu_rx_ts_unwrap(u32 ts, u32 *epoch, u32 *last,
+				   unsigned int bits)
+{
+	if (ts < *last)
+		(*epoch)++;
+	*last = ts;
+
+	return ((u64)*epoch << bits) | ts;
+}
+
+#define HPU_RX_TS64_BATCH	32
+
+/*
+ * Copy the events of a RX buffer to userspace with unwrapped timestamps;
+ * only whole events are copied. Sets how many bytes of the buffer have been
+ * consumed and how many bytes have been copied; fails if less than @length
+ * (rounded down to whole events) could be copied.
+ */
+static int hpu_rx_copy_ts64(struct hpu_file *hf, struct hpu_buf *item,
+			    struct iov_iter *to, size_t length,
+			    size_t *copy, size_t *out)
+{
+	hpu_rx_ts64_event_t ev[HPU_RX_TS64_BATCH];
+	u32 *data = item->virt + hf->rx_offs;
+	unsigned int bits = item->ts_bits;
+	u32 mask = hpu_ts_mask(bits);
+	size_t left = item->tail_index - hf->rx_offs;
+	size_t n = min(left / 8, length / sizeof(ev[0]));
+	size_t i, j, done;
+	u32 epoch, last;
+	u64 ts64;
+	int ret = 0;
+
+	if (!hf->rx_offs)
+		hpu_rx_ts64_start(hf, item);
+	epoch = hf->rx_ts_epoch;
+	last = hf->rx_ts_last;
+
+	for (i = 0; i < n; i += j) {
+		for (j = 0; j < HPU_RX_TS64_BATCH && i + j < n; j++) {
+			ts64 = hpu_rx_ts_unwrap(data[(i + j) * 2] & mask,
+						&epoch, &last, bits);
+			ev[j].ts_lo = lower_32_bits(ts64);
+			ev[j].ts_hi = upper_32_bits(ts64);
+			ev[j].addr = data[(i + j) * 2 + 1];
+		}
+
+		done = copy_to_iter(ev, j * sizeof(ev[0]), to) / sizeof(ev[0]);
+		if (done < j) {
+			/* go on from the last event actually copied */
+			if (done) {
+				ts64 = ((u64)ev[done - 1].ts_hi << 32) |
+					ev[done - 1].ts_lo;
+				epoch = ts64 >> bits;
+				last = ts64 & mask;
+			} else {
+				epoch = hf->rx_ts_epoch;
+				last = hf->rx_ts_last;
+			}
+			i += done;
+			ret = -EFAULT;
+			break;
+		}
+		hf->rx_ts_epoch = epoch;
+		hf->rx_ts_last = last;
+	}
+
+	hf->rx_ts_epoch = epoch;
+	hf->rx_ts_last = last;
+	*copy = i * 8;
+	/* skip any trailing word that doesn't make a whole event */
+	if (!ret && left - *copy < 8)
+		*copy = left;
+	*out = i * sizeof(ev[0]);
+
+	return ret;
+}
+
+/* worst case RX_FORMAT_DELTA size of n events: a sync point for each one */
+#define HPU_RX_DELTA_MAX_LEN(n)	((n) * (sizeof(hpu_rx_delta_sync_t) + 11))
+
+static u8 *hpu_rx_delta_put(u8 *p, u32 val, u8 *ctrl, unsigned int shift)
+{
+	unsigned int len = 1 + (val > 0xff) + (val > 0xffff) + (val > 0xffffff);
+
+	*ctrl |= (len - 1) << shift;
+	while (len--) {
+		*p++ = val;
+		val >>= 8;
+	}
+
+	return p;
+}
+
+/* fill the count of a block of delta encoded events and pad its last group */
+static u8 *hpu_rx_delta_end(u8 *p, u8 *blk, u32 count)
+{
+	hpu_rx_delta_sync_t sync;
+
+	if (!blk)
+		return p;
+
+	memcpy(&sync, blk, sizeof(sync));
+	sync.count = count;
+	memcpy(blk, &sync, sizeof(sync));
+	if (count % 2) {
+		*p++ = 0;
+		*p++ = 0;
+	}
+
+	return p;
+}
+
+/*
+ * Convert a whole RX buffer to the reader format, in the reader staging
+ * area, keeping only the events coming from the sources it has selected.
+ * With RX_FORMAT_DELTA each buffer starts with a sync point, so it can be
+ * decoded on its own; another one is put whenever the timestamp delta
+ * doesn't fit in 32 bits.
+ * Must be called with RX lock held.
+ */
+static int hpu_rx_stage(struct hpu_file *hf, struct hpu_buf *item)
+{
+	u32 *data = item->virt;
+	unsigned int bits = item->ts_bits;
+	u32 mask = hpu_ts_mask(bits);
+	unsigned int words = hf->priv->rx_ts_disable ? 1 : 2;
+	unsigned int i, n = item->tail_index / (words * 4);
+	hpu_rx_delta_sync_t sync;
+	hpu_rx_ts64_event_t ev;
+	u8 *p, *blk = NULL, *ctrl = NULL;
+	u32 epoch, last, addr, prev_addr = 0, count = 0;
+	u64 ts64 = 0, prev = 0;
+	size_t size;
+
+	if (!n) {
+		hf->rx_stage_len = 0;
+		hf->rx_staged = true;
+		return 0;
+	}
+
+	if (hf->rx_format == RX_FORMAT_DELTA)
+		size = HPU_RX_DELTA_MAX_LEN(n);
+	else if (hf->rx_format == RX_FORMAT_TS64)
+		size = n * sizeof(ev);
+	else
+		size = n * words * 4;
+
+	if (hf->rx_stage_size < size) {
+		kvfree(hf->rx_stage);
+		hf->rx_stage_size = 0;
+		hf->rx_stage = kvmalloc(size, GFP_KERNEL);
+		if (!hf->rx_stage)
+			return -ENOMEM;
+		hf->rx_stage_size = size;
+	}
+
+	/* all the events are needed to unwrap the timestamps right */
+	if (hf->rx_format != RX_FORMAT_RAW)
+		hpu_rx_ts64_start(hf, item);
+	epoch = hf->rx_ts_epoch;
+	last = hf->rx_ts_last;
+	p = hf->rx_stage;
+
+	for (i = 0; i < n; i++) {
+		addr = data[i * words + words - 1];
+		if (hf->rx_format != RX_FORMAT_RAW)
+			ts64 = hpu_rx_ts_unwrap(data[i * 2] & mask, &epoch,
+						&last, bits);
+		if (!hpu_rx_src_match(hf, addr))
+			continue;
+
+		if (hf->rx_format == RX_FORMAT_RAW) {
+			memcpy(p, &data[i * words], words * 4);
+			p += words * 4;
+			continue;
+		}
+
+		if (hf->rx_format == RX_FORMAT_TS64) {
+			ev.ts_lo = lower_32_bits(ts64);
+			ev.ts_hi = upper_32_bits(ts64);
+			ev.addr = addr;
+			memcpy(p, &ev, sizeof(ev));
+			p += sizeof(ev);
+			continue;
+		}
+
+		if (!blk || ts64 - prev > U32_MAX) {
+			p = hpu_rx_delta_end(p, blk, count);
+			blk = p;
+			sync.ts_lo = lower_32_bits(ts64);
+			sync.ts_hi = upper_32_bits(ts64);
+			sync.count = 0;
+			memcpy(p, &sync, sizeof(sync));
+			p += sizeof(sync);
+			prev = ts64;
+			prev_addr = 0;
+			count = 0;
+		}
+
+		if (!(count % 2)) {
+			ctrl = p++;
+			*ctrl = 0;
+		}
+		p = hpu_rx_delta_put(p, ts64 - prev, ctrl, (count % 2) * 4);
+		p = hpu_rx_delta_put(p, addr ^ prev_addr, ctrl, (count % 2) * 4 + 2);
+		prev = ts64;
+		prev_addr = addr;
+		count++;
+	}
+	p = hpu_rx_delta_end(p, blk, count);
+
+	hf->rx_ts_epoch = epoch;
+	hf->rx_ts_last = last;
+	hf->rx_stage_len = p - (u8 *)hf->rx_stage;
+	hf->rx_staged = true;
+
+	return 0;
+}
+
+/*
+ * How many RX buffers a reader sharing them gets at once: a fair share of
+ * the available ones, so that they are spread among all the readers. The
+ * share is per open file: a process sharing through several ones gets a
+ * share for each of them.
+ */
+static unsigned int hpu_rx_share_quota(struct hpu_priv *priv,
+				       unsigned int avail)
+{
+	return DIV_ROUND_UP(avail, priv->rx_share_nr);
+}
+
+/*
+ * read() for readers sharing the RX buffers: only whole buffers are
+ * returned, each one preceded by its metadata header, so that the sequence
+ * numbers can be used to put them back in order.
+ * Must be called with RX lock held.
+ */
+static ssize_t hpu_rx_read_share(struct hpu_file *hf, struct iov_iter *to,
+				 bool nowait)
+{
+	struct hpu_priv *priv = hf->priv;
+	struct hpu_dma_pool *pool = &priv->dma_rx_pool;
+	size_t length = iov_iter_count(to);
+	ssize_t read = 0;
+	unsigned int avail;
+	struct hpu_buf *item;
+	hpu_rx_meta_t meta;
+	int ret;
+
+	while (1) {
+		ret = hpu_rx_check_fifo(priv, nowait);
+		if (ret)
+			return ret;
+
+		avail = hpu_rx_reader_filled(hf);
+		if (avail)
+			break;
+
+		if (nowait)
+			return -EAGAIN;
+
+		ret = hpu_rx_wait(hf);
+		if (unlikely(ret < 0))
+			return ret;
+	}
+
+	for (avail = hpu_rx_share_quota(priv, avail); avail; avail--) {
+		item = &pool->ring[priv->rx_share_claim & (pool->pn - 1)];
+		if (length < sizeof(meta) + item->tail_index) {
+			if (!read)
+				read = -EINVAL;
+			break;
+		}
+
+		hpu_rx_fill_meta(item, &meta, item->tail_index, priv->rx_share_gap);
+		if (copy_to_iter(&meta, sizeof(meta), to) != sizeof(meta) ||
+		    copy_to_iter(item->virt, item->tail_index, to) !=
+		    item->tail_index) {
+			if (!read)
+				read = -EFAULT;
+			break;
+		}
+
+		priv->rx_share_gap = 0;
+		priv->rx_bytes_delivered += item->tail_index;
+		item->done = true;
+		priv->rx_share_claim++;
+		read += sizeof(meta) + item->tail_index;
+		length -= sizeof(meta) + item->tail_index;
+	}
+	hpu_rx_readers_release(priv);
+
+	return read;
+}
+
+static ssize_t hpu_chardev_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	int ret;
+	size_t copy;
+	size_t out;
+	size_t buf_len;
+	size_t buf_count;
+	void *buf_data;
+	bool staged;
+	struct hpu_buf *item;
+	size_t read = 0;
+	unsigned int avail = 0;
+	unsigned int consumed = 0;
+	hpu_rx_meta_t meta;
+	struct file *fp = iocb->ki_filp;
+	struct hpu_file *hf = fp->private_data;
+	struct hpu_priv *priv = hf->priv;
+	size_t length = iov_iter_count(to);
+	bool nowait = (iocb->ki_flags & IOCB_NOWAIT) ||
+		(fp->f_flags & O_NONBLOCK);
+
+	/* the RX ring is being consumed through mmap() */
+	if (atomic_read(&hf->rx_ring_mapped))
+		return -EBUSY;
+
+	dev_dbg(&priv->pdev->dev, "----tot to read %zu\n", length);
+
+	if (nowait) {
+		if (!mutex_trylock(&priv->dma_rx_pool.mutex_lock))
+			return -EAGAIN;
+	} else {
+		mutex_lock(&priv->dma_rx_pool.mutex_lock);
+	}
+
+	if (hf->rx_share && length) {
+		read = hpu_rx_read_share(hf, to, nowait);
+		mutex_unlock(&priv->dma_rx_pool.mutex_lock);
+		if ((ssize_t)read >= 0) {
+			hpu_stats_hist(hpu_stats_begin(priv)->read_hist, read);
+			hpu_stats_end(priv);
+		}
+		return read;
+	}
+
+	/* converted events are never split (the metadata header fits too) */
+	if (hf->rx_format == RX_FORMAT_TS64) {
+		length -= length % sizeof(hpu_rx_ts64_event_t);
+		if (!length && iov_iter_count(to))
+			read = -EINVAL;
+	}
+
+	while (length > 0) {
+		/*
+		 * Consume all the buffers found filled in one pass, without
+		 * looking at the head index again; when they are over give
+		 * them back to the DMA all together, then look for more data
+		 * and possibly wait.
+		 */
+		if (!avail) {
+			if (consumed) {
+				hf->rx_cursor += consumed;
+				hpu_rx_readers_release(priv);
+				consumed = 0;
+			}
+
+			while (1) {
+				/* report skipped data before what follows it */
+				if (hf->rx_overrun) {
+					if (!read) {
+						hf->rx_overrun = false;
+						read = -EOVERFLOW;
+					}
+					goto exit;
+				}
+
+				ret = hpu_rx_check_fifo(priv, nowait);
+				if (ret == -EAGAIN) {
+					if (!read)
+						read = -EAGAIN;
+					goto exit;
+				}
+				if (ret)
+					goto error_rx_fifo_full;
+
+				/* if there is data, then do not wait .. */
+				avail = hpu_rx_reader_filled(hf);
+				if (avail)
+					break;
+
+				/* if we have read enough not to block then return now */
+				if (read >= priv->rx_blocking_threshold)
+					goto exit;
+
+				if (nowait) {
+					if (!read)
+						read = -EAGAIN;
+					goto exit;
+				}
+
+				ret = hpu_rx_wait(hf);
+				if (unlikely(ret < 0)) {
+					read = ret;
+					goto exit;
+				}
+				avail = ret;
+				if (avail)
+					break;
+			}
+		}
+
+		item = &priv->dma_rx_pool.ring[(hf->rx_cursor + consumed) &
+					       (priv->dma_rx_pool.pn - 1)];
+		dev_dbg(&priv->pdev->dev, "reading dma descriptor %ld\n",
+			(long)(item - priv->dma_rx_pool.ring));
+
+		/* data still in buf, possibly once converted */
+		buf_data = item->virt;
+		buf_len = item->tail_index;
+		staged = hpu_rx_needs_stage(hf);
+		if (staged) {
+			if (!hf->rx_staged) {
+				ret = hpu_rx_stage(hf, item);
+				if (ret) {
+					if (!read)
+						read = ret;
+					break;
+				}
+			}
+			buf_data = hf->rx_stage;
+			buf_len = hf->rx_stage_len;
+		}
+		buf_count = buf_len - hf->rx_offs;
+
+		/* prepend the metadata header; never split it across reads */
+		if (hf->rx_meta && !hf->rx_meta_sent) {
+			if (length < sizeof(hpu_rx_meta_t)) {
+				if (!read)
+					read = -EINVAL;
+				break;
+			}
+
+			hpu_rx_fill_meta(item, &meta, hpu_rx_out_len(hf, buf_count),
+					 hf->rx_meta_gap);
+			if (copy_to_iter(&meta, sizeof(meta), to) != sizeof(meta)) {
+				if (!read)
+					read = -EFAULT;
+				break;
+			}
+			hf->rx_meta_gap = 0;
+			hf->rx_meta_sent = true;
+			read += sizeof(meta);
+			length -= sizeof(meta);
+		}
+
+		dev_dbg(&priv->pdev->dev, "going to read %zu bytes from offset %d\n",
+			length, hf->rx_offs);
+
+		if (hf->rx_format == RX_FORMAT_TS64 && !staged) {
+			ret = hpu_rx_copy_ts64(hf, item, to, length, &copy, &out);
+		} else {
+			copy = min(length, buf_count);
+			/* ret is the number of _uncopied_ bytes */
+			ret = copy - copy_to_iter(buf_data + hf->rx_offs, copy, to);
+			copy -= ret;
+			out = copy;
+		}
+
+		BUG_ON((hf->rx_offs + copy) > buf_len);
+		if ((hf->rx_offs + copy) == buf_len) {
+			/* Buffer fully read. */
+			dev_dbg(&priv->pdev->dev, "fully consumed\n");
+			priv->rx_bytes_delivered += item->tail_index;
+			hf->rx_offs = 0;
+			hf->rx_meta_sent = false;
+			hf->rx_staged = false;
+			consumed++;
+			avail--;
+			/* don't starve the DMA during long reads */
+			if (consumed == priv->dma_rx_pool.pn / 3) {
+				hf->rx_cursor += consumed;
+				hpu_rx_readers_release(priv);
+				consumed = 0;
+				/* we might have been lagging too much ourselves */
+				if (hf->rx_overrun)
+					avail = 0;
+			}
+		} else {
+			/* buffer partially consumed, advance in-buffer index */
+			hf->rx_offs += copy;
+			BUG_ON(hf->rx_offs >= buf_len);
+			dev_dbg(&priv->pdev->dev, "partially consumed, up to %d\n",
+				hf->rx_offs);
+		}
+
+		read += out;
+		length -= out;
+		BUG_ON(length < 0);
+		dev_dbg(&priv->pdev->dev, "read %zu, rem %zu\n", read, length);
+
+		/* partially copied */
+		if (ret)
+			break;
+	}
+
+exit:
+	if (consumed) {
+		hf->rx_cursor += consumed;
+		hpu_rx_readers_release(priv);
+	}
+	dev_dbg(&priv->pdev->dev, "----END read\n");
+
+	mutex_unlock(&priv->dma_rx_pool.mutex_lock);
+	if ((ssize_t)read >= 0) {
+		hpu_stats_hist(hpu_stats_begin(priv)->read_hist, read);
+		hpu_stats_end(priv);
+	}
+	return read;
+
+error_rx_fifo_full:
+	mutex_unlock(&priv->dma_rx_pool.mutex_lock);
+
+	return -ENOMEM;
+}
+
+/*
+ * Report the RX loss accounting in events. Events dropped by the HPU while
+ * its FIFO is full are not counted by the IP, so they can't be reported.
+ * Must be called with RX lock held.
+ */
+static void hpu_get_rx_loss_stats(struct hpu_priv *priv,
+				  hpu_rx_loss_stats_t *stats)
+{
+	u32 ev_size = priv->rx_ts_disable ? 4 : 8;
+	unsigned long flags;
+	unsigned int start;
+	u64 produced;
+
+	do {
+		start = u64_stats_fetch_begin(&priv->rx_bytes_syncp);
+		produced = priv->rx_bytes_produced;
+	} while (u64_stats_fetch_retry(&priv->rx_bytes_syncp, start));
+
+	stats->produced = div_u64(produced, ev_size);
+	stats->delivered = div_u64(priv->rx_bytes_delivered, ev_size);
+	stats->lost_overflow =
+		div_u64(priv->rx_bytes_lost[HPU_RX_LOSS_OVERFLOW], ev_size);
+	stats->lost_drain =
+		div_u64(priv->rx_bytes_lost[HPU_RX_LOSS_DRAIN], ev_size);
+	stats->lost_flush =
+		div_u64(priv->rx_bytes_lost[HPU_RX_LOSS_FLUSH], ev_size);
+	/* counted by the IRQ handler */
+	spin_lock_irqsave(&priv->irq_lock, flags);
+	stats->overflows = priv->rx_fifo_overflows;
+	spin_unlock_irqrestore(&priv->irq_lock, flags);
+}
+
+/*
+ * Give back to the DMA the RX buffers that userspace has consumed through
+ * the mmap() interface, then wait for filled buffers to be available.
+ */
+static int hpu_rx_ring_sync(struct hpu_file *hf, hpu_rx_ring_sync_t *sync,
+			    bool nonblock)
+{
+	struct hpu_priv *priv = hf->priv;
+	struct hpu_dma_pool *pool = &priv->dma_rx_pool;
+	int ret = 0;
+	unsigned int avail, i;
+
+	mutex_lock(&priv->dma_rx_pool.mutex_lock);
+
+	if (hf->rx_share) {
+		/* give back all the buffers got by the previous call */
+		priv->rx_bytes_delivered += hpu_rx_bufs_bytes(priv, hf->rx_cursor,
+							      hf->rx_claimed);
+		for (i = 0; i < hf->rx_claimed; i++)
+			pool->ring[(hf->rx_cursor + i) & (pool->pn - 1)].done = true;
+		hf->rx_claimed = 0;
+		hpu_rx_readers_release(priv);
+	} else if (hf->rx_overrun) {
+		/* the buffers to be released have been already skipped */
+		hf->rx_overrun = false;
+		ret = -EOVERFLOW;
+		avail = hpu_rx_reader_filled(hf);
+		goto out;
+	} else {
+		/*
+		 * release is the index past the last consumed buffer: a stale
+		 * one (e.g. from before an RX flush moved the cursor) is refused,
+		 * so that buffers never read are not given back
+		 */
+		avail = sync->release - hf->rx_cursor;
+		if (avail > hpu_rx_reader_filled(hf)) {
+			ret = -EINVAL;
+			avail = hpu_rx_reader_filled(hf);
+			goto out;
+		}
+		if (avail) {
+			priv->rx_bytes_delivered +=
+				hpu_rx_bufs_bytes(priv, hf->rx_cursor, avail);
+			hf->rx_cursor += avail;
+			hpu_rx_readers_release(priv);
+		}
+	}
+
+	while (1) {
+		if (hf->rx_overrun) {
+			hf->rx_overrun = false;
+			ret = -EOVERFLOW;
+			avail = hpu_rx_reader_filled(hf);
+			break;
+		}
+
+		ret = hpu_rx_check_fifo(priv, false);
+		if (ret)
+			break;
+
+		avail = hpu_rx_reader_filled(hf);
+		if (avail)
+			break;
+
+		if (nonblock) {
+			ret = -EAGAIN;
+			break;
+		}
+
+		ret = hpu_rx_wait(hf);
+		if (unlikely(ret < 0))
+			break;
+		avail = ret;
+		ret = 0;
+		if (avail)
+			break;
+	}
+
+	/* get a share of the available buffers, that nobody else will get */
+	if (hf->rx_share && !ret) {
+		avail = hpu_rx_share_quota(priv, avail);
+		hf->rx_cursor = priv->rx_share_claim;
+		hf->rx_claimed = avail;
+		priv->rx_share_claim += avail;
+	}
+out:
+	sync->first = hf->rx_cursor;
+	sync->avail = (ret && ret != -EOVERFLOW && ret != -EINVAL) ? 0 : avail;
+	mutex_unlock(&priv->dma_rx_pool.mutex_lock);
+
+	return ret;
+}
+
+static __poll_t hpu_chardev_poll(struct file *fp, poll_table *wait)
+{
+	struct hpu_file *hf = fp->private_data;
+	struct hpu_priv *priv = hf->priv;
+	__poll_t mask = 0;
+
+	poll_wait(fp, &priv->dma_rx_pool.poll_wq, wait);
+	if (priv->dma_tx_chan)
+		poll_wait(fp, &priv->dma_tx_pool.poll_wq, wait);
+
+	if (hpu_rx_reader_filled(hf) || READ_ONCE(hf->rx_overrun))
+		mask |= EPOLLIN | EPOLLRDNORM;
+
+	/*
+	 * On RX FIFO overflow a read() is needed to get the failure reported
+	 * and/or to restart the RX path.
+	 */
+	if (!hpu_rx_fifo_ok(priv))
+		mask |= EPOLLIN | EPOLLRDNORM | EPOLLERR;
 
-		priv->dma_tx_pool.buf_index = (priv->dma_tx_pool.buf_index + 1)
-			& (priv->dma_tx_pool.pn - 1);
+	if (priv->dma_tx_chan) {
+		poll_wait(fp, &priv->tx_queue_wq, wait);
+		if (READ_ONCE(priv->tx_queue) ?
+		    READ_ONCE(priv->tx_queue_len) < READ_ONCE(priv->tx_queue_size) :
+		    READ_ONCE(priv->dma_tx_pool.filled) < priv->dma_tx_pool.pn)
+			mask |= EPOLLOUT | EPOLLWRNORM;
 	}
-exit:
-	mutex_unlock(&priv->dma_tx_pool.mutex_lock);
-	if (count)
-		dma_async_issue_pending(priv->dma_tx_chan);
 
-	return i;
+	return mask;
 }
 
-/* those three func are called with irq lock held */
-static void hpu_rx_suspend(struct hpu_priv *priv)
+static void hpu_rx_ring_vma_open(struct vm_area_struct *vma)
 {
-	priv->rx_suspended = 1;
-	hpu_reg_write(priv, 0, HPU_RXCTRL_REG);
-	hpu_reg_write(priv, 0, HPU_AUX_RXCTRL_REG);
-	priv->ctrl_reg &= ~HPU_CTRL_LOOP_LNEAR;
-	hpu_reg_write(priv, priv->ctrl_reg , HPU_CTRL_REG);
+	struct hpu_file *hf = vma->vm_private_data;
+
+	atomic_inc(&hf->rx_ring_mapped);
+	atomic_inc(&hf->priv->rx_ring_mapped);
 }
 
-static void hpu_rx_resume(struct hpu_priv *priv)
+static void hpu_rx_ring_vma_close(struct vm_area_struct *vma)
 {
-	priv->rx_suspended = 0;
-	hpu_reg_write(priv, priv->rx_ctrl_reg, HPU_RXCTRL_REG);
-	hpu_reg_write(priv, priv->rx_aux_ctrl_reg, HPU_AUX_RXCTRL_REG);
-	priv->ctrl_reg |= priv->loop_bits;
-	hpu_reg_write(priv, priv->ctrl_reg, HPU_CTRL_REG);
+	struct hpu_file *hf = vma->vm_private_data;
+
+	atomic_dec(&hf->rx_ring_mapped);
+	atomic_dec(&hf->priv->rx_ring_mapped);
 }
 
-static int hpu_rx_is_suspended(struct hpu_priv *priv)
+static const struct vm_operations_struct hpu_rx_ring_vm_ops = {
+	.open = hpu_rx_ring_vma_open,
+	.close = hpu_rx_ring_vma_close,
+};
+
+static void hpu_tx_ring_vma_open(struct vm_area_struct *vma)
 {
-	return priv->rx_suspended;
+	struct hpu_priv *priv = vma->vm_private_data;
+
+	atomic_inc(&priv->tx_ring_mapped);
 }
 
-static ssize_t hpu_chardev_read(struct file *fp, char *buf, size_t length,
-				loff_t *offset)
+static void hpu_tx_ring_vma_close(struct vm_area_struct *vma)
 {
-	int ret;
-	__maybe_unused int ret2;
-	size_t copy;
-	int index;
-	size_t buf_count;
-	struct hpu_buf *item;
-	unsigned long flags;
-	size_t read = 0;
-	int submitted = 0;
-	struct hpu_priv *priv = fp->private_data;
-#if LINUX_VERSION_CODE < KERNEL_VERSION(5,0,0)
-	if (!access_ok(VERIFY_READ, buf, length))
-#else
-	if (!access_ok(buf, length))
-#endif
-		return -EFAULT;
+	struct hpu_priv *priv = vma->vm_private_data;
 
-	dev_dbg(&priv->pdev->dev, "----tot to read %zu\n", length);
+	atomic_dec(&priv->tx_ring_mapped);
+}
 
-	mutex_lock(&priv->dma_rx_pool.mutex_lock);
+static const struct vm_operations_struct hpu_tx_ring_vm_ops = {
+	.open = hpu_tx_ring_vma_open,
+	.close = hpu_tx_ring_vma_close,
+};
 
-	while (length > 0) {
-		/*
-		 * Wait for some data to be available - this part must lock
-		 * against the DMA cb, in order to correctly handle filled count
-		 * and completion wakeup
-		 */
-		while (1) {
-			switch(READ_ONCE(priv->rx_fifo_status)) {
-			case FIFO_OK:
-				break;
+static void hpu_ctrl_vma_open(struct vm_area_struct *vma)
+{
+	struct hpu_priv *priv = vma->vm_private_data;
 
-			case FIFO_OVERFLOW:
-				/*
-				 * FIFO-full, nobody cared yet. Bail out failing
-				 * and mark as 'notified'.
-				 */
-				WRITE_ONCE(priv->rx_fifo_status,
-					   FIFO_OVERFLOW_NOTIFIED);
-				goto error_rx_fifo_full;
-				break;
+	atomic_inc(&priv->ctrl_mapped);
+}
 
-			case FIFO_DRAINED:
-				/*
-				 * FIFO-full, already drained. Bail out failing
-				 * but next time we'll be OK.
-				 */
-				WRITE_ONCE(priv->rx_fifo_status, FIFO_STOPPED);
-				goto error_rx_fifo_full;
-				break;
+static void hpu_ctrl_vma_close(struct vm_area_struct *vma)
+{
+	struct hpu_priv *priv = vma->vm_private_data;
 
-			case FIFO_OVERFLOW_NOTIFIED:
-				/*
-				 * FIFO-full, we had already notified this, but
-				 * no-one has drained the fifo yet. Do it now,
-				 * then we are OK and we can go on without fail.
-				 */
-				hpu_flush_rx(priv);
-
-				/* fall-through */
-			case FIFO_STOPPED:
-				/*
-				 * An overflow has been fixed. We have to
-				 * restart the RX machanism, then we can go on.
-				 */
-				spin_lock_irqsave(&priv->irq_lock, flags);
-				hpu_rx_resume(priv);
+	atomic_dec(&priv->ctrl_mapped);
+}
 
-				/* Re-enable RX FIFO full interrupt */
-				priv->irq_msk |= HPU_MSK_INT_RXFIFOFULL;
-				hpu_reg_write(priv, priv->irq_msk, HPU_IRQMASK_REG);
+static const struct vm_operations_struct hpu_ctrl_vm_ops = {
+	.open = hpu_ctrl_vma_open,
+	.close = hpu_ctrl_vma_close,
+};
 
-				WRITE_ONCE(priv->rx_fifo_status, FIFO_OK);
-				spin_unlock_irqrestore(&priv->irq_lock, flags);
-				break;
-			}
-			/*
-			 * Quoting Documentation/dmaengine/client.txt:
-			 * Note that callbacks will always be invoked from the DMA
-			 * engines tasklet, never from interrupt context.
-			 */
-			spin_lock_bh(&priv->dma_rx_pool.spin_lock);
+static int hpu_mmap_ctrl(struct hpu_priv *priv, struct vm_area_struct *vma)
+{
+	int ret;
 
+	ret = remap_vmalloc_range(vma, priv->ring_ctrl, 0);
+	if (ret)
+		return ret;
 
-			/* if there is data, then do not wait .. */
-			if (priv->dma_rx_pool.filled > 0) {
-				spin_unlock_bh(&priv->dma_rx_pool.spin_lock);
-				break;
-			}
+	vma->vm_private_data = priv;
+	vma->vm_ops = &hpu_ctrl_vm_ops;
+	hpu_ctrl_vma_open(vma);
 
-			/* if we have read enough not to block then return now */
-			if (read >= priv->rx_blocking_threshold) {
-				spin_unlock_bh(&priv->dma_rx_pool.spin_lock);
-				goto exit;
-			}
+	return 0;
+}
 
-			/* drain away any completion leftover */
-			try_wait_for_completion(&priv->dma_rx_pool.completion);
-			spin_unlock_bh(&priv->dma_rx_pool.spin_lock);
-
-			dev_dbg(&priv->pdev->dev, "wait for dma\n");
-			ret = wait_for_completion_killable_timeout(&priv->dma_rx_pool.completion,
-									msecs_to_jiffies(rx_to));
-			if (unlikely(ret < 0)) {
-				read = ret;
-				goto exit;
-			} else if (unlikely(ret == 0)) {
-				dev_err(&priv->pdev->dev, "DMA timed out\n");
-				read = -ETIMEDOUT;
-				goto exit;
-			}
-		}
+/* map a whole ring, that is a single contiguous region */
+static int hpu_mmap_pool(struct hpu_priv *priv, struct hpu_dma_pool *pool,
+			 struct vm_area_struct *vma)
+{
+	if (vma->vm_end - vma->vm_start != pool->size)
+		return -EINVAL;
 
-		index = priv->dma_rx_pool.buf_index;
-		item = &priv->dma_rx_pool.ring[index];
-		dev_dbg(&priv->pdev->dev, "reading dma descriptor %d\n", index);
+#ifdef HPU_DMA_STREAMING
+	return remap_pfn_range(vma, vma->vm_start,
+			       page_to_pfn(virt_to_page(pool->virt)),
+			       pool->size, vma->vm_page_prot);
+#else
+	vma->vm_pgoff = 0;
+	return dma_mmap_coherent(&priv->pdev->dev, vma, pool->virt,
+				 pool->phys, pool->size);
+#endif
+}
 
-		/* data still in buf */
-		buf_count = item->tail_index - item->head_index;
-		copy = min(length, buf_count);
+static int hpu_mmap_rx_ring(struct hpu_file *hf, struct vm_area_struct *vma)
+{
+	int ret;
 
-		dev_dbg(&priv->pdev->dev, "going to read %zu bytes from offset %d\n",
-			length, item->head_index);
+	ret = hpu_mmap_pool(hf->priv, &hf->priv->dma_rx_pool, vma);
+	if (ret)
+		return ret;
 
-		ret = __copy_to_user(buf + read,
-				     item->virt + item->head_index, copy);
-		if (ret < 0) {
-			dev_warn(&priv->pdev->dev, "failed to copy from userspace");
-			break;
-		}
-		/* if ret > 0, then it is the number of _uncopied_ bytes */
-		copy -= ret;
+	vma->vm_private_data = hf;
+	vma->vm_ops = &hpu_rx_ring_vm_ops;
+	hpu_rx_ring_vma_open(vma);
 
-		BUG_ON((item->head_index + copy) > item->tail_index);
-		if ((item->head_index + copy) == item->tail_index) {
-			/* Buffer fully read. */
-			dev_dbg(&priv->pdev->dev, "fully consumed\n");
+	return 0;
+}
 
-			/* update filled count locking against DMA cb */
-			spin_lock_bh(&priv->dma_rx_pool.spin_lock);
-			priv->dma_rx_pool.filled--;
-			spin_unlock_bh(&priv->dma_rx_pool.spin_lock);
+static int hpu_mmap_tx_ring(struct hpu_priv *priv, struct vm_area_struct *vma)
+{
+	int ret;
 
-			/* resubmit DMA buffer */
-#ifdef HPU_DMA_DEFER_SUBMIT
-			hpu_rx_dma_submit_buffer_deferred(priv, &priv->dma_rx_pool.ring[index]);
-#else
-			ret2 = hpu_rx_dma_submit_buffer(priv, &priv->dma_rx_pool.ring[index]);
-			if (ret2)
-				dev_err(&priv->pdev->dev,
-					"DMA RX submit error %d while reading\n",
-                                       ret2);
-#endif
-			submitted++;
+	if (!priv->dma_tx_chan)
+		return -ENODEV;
 
-			priv->dma_rx_pool.buf_index = (priv->dma_rx_pool.buf_index + 1)
-				& (priv->dma_rx_pool.pn - 1);
-			BUG_ON(priv->dma_rx_pool.buf_index >= priv->dma_rx_pool.pn);
-			if (submitted == priv->dma_rx_pool.pn / 3) {
-#ifdef HPU_DMA_DEFER_SUBMIT
-				hpu_rx_dma_wake_deferred(priv);
-#else
-				dma_async_issue_pending(priv->dma_rx_chan);
-#endif
-				submitted = 0;
-			}
-		} else {
-			/* buffer partially consumed, advance in-buffer index */
-			item->head_index += copy;
-			BUG_ON(item->head_index >= item->tail_index);
-			dev_dbg(&priv->pdev->dev, "partially consumed, up to %d\n",
-				item->head_index);
-		}
+	/* the current TX buffer may be taken by write-combining */
+	if (READ_ONCE(priv->tx_wc_us) || READ_ONCE(priv->tx_queue) ||
+	    READ_ONCE(priv->tx_pattern_on))
+		return -EBUSY;
 
-		read += copy;
-		length -= copy;
-		BUG_ON(length < 0);
-		dev_dbg(&priv->pdev->dev, "read %zu, rem %zu\n", read, length);
+	ret = hpu_mmap_pool(priv, &priv->dma_tx_pool, vma);
+	if (ret)
+		return ret;
 
-		/* partially copied */
-		if (ret)
-			break;
-	}
+	vma->vm_private_data = priv;
+	vma->vm_ops = &hpu_tx_ring_vm_ops;
+	hpu_tx_ring_vma_open(vma);
 
-exit:
-	if (submitted) {
-#ifdef HPU_DMA_DEFER_SUBMIT
-		hpu_rx_dma_wake_deferred(priv);
+	return 0;
+}
+
+static int hpu_chardev_mmap(struct file *fp, struct vm_area_struct *vma)
+{
+	struct hpu_file *hf = fp->private_data;
+	struct hpu_priv *priv = hf->priv;
+	unsigned long offs = vma->vm_pgoff << PAGE_SHIFT;
+	int ret;
+
+	/* everything but the TX ring is read-only for userspace */
+	if (offs != HPU_MMAP_TX_RING_OFFS) {
+		if (vma->vm_flags & VM_WRITE)
+			return -EPERM;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,3,0)
+		vma->vm_flags &= ~VM_MAYWRITE;
 #else
-		dma_async_issue_pending(priv->dma_rx_chan);
+		vm_flags_clear(vma, VM_MAYWRITE);
 #endif
 	}
-	dev_dbg(&priv->pdev->dev, "----END read\n");
-
-	mutex_unlock(&priv->dma_rx_pool.mutex_lock);
-	return read;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,3,0)
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+#else
+	vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+#endif
 
-error_rx_fifo_full:
-	mutex_unlock(&priv->dma_rx_pool.mutex_lock);
+	/* the rings must not be swapped while they are being mapped */
+	mutex_lock(&priv->map_lock);
+	switch (offs) {
+	case HPU_MMAP_CTRL_OFFS:
+		ret = hpu_mmap_ctrl(priv, vma);
+		break;
+	case HPU_MMAP_RX_RING_OFFS:
+		ret = hpu_mmap_rx_ring(hf, vma);
+		break;
+	case HPU_MMAP_TX_RING_OFFS:
+		ret = hpu_mmap_tx_ring(priv, vma);
+		break;
+	default:
+		ret = -EINVAL;
+	}
+	mutex_unlock(&priv->map_lock);
 
-	return -ENOMEM;
+	return ret;
 }
 
 static int hpu_dma_init(struct hpu_priv *priv)
@@ -1310,14 +4492,37 @@ static int hpu_dma_init(struct hpu_priv *priv)
 		dev_notice(&priv->pdev->dev, "Can't bind TX DMA chan: write disabled\n");
 	}
 
-	priv->fops.write = priv->dma_tx_chan ? hpu_chardev_write : NULL;
+	priv->fops.write_iter = priv->dma_tx_chan ? hpu_chardev_write_iter : NULL;
+	priv->fops.fsync = priv->dma_tx_chan ? hpu_chardev_fsync : NULL;
 
 	return 0;
 }
 
+static void hpu_rx_dma_free_desc(struct hpu_priv *priv)
+{
+	int i;
+
+	if (!priv->dma_rx_pool.ring)
+		return;
+
+	/*
+	 * Reusable descriptors are not freed by the DMA driver on completion;
+	 * make sure none of them is still queued, then free them.
+	 */
+	dmaengine_terminate_sync(priv->dma_rx_chan);
+	for (i = 0; i < priv->dma_rx_pool.pn; i++) {
+		if (priv->dma_rx_pool.ring[i].desc)
+			dmaengine_desc_free(priv->dma_rx_pool.ring[i].desc);
+		priv->dma_rx_pool.ring[i].desc = NULL;
+	}
+}
+
 static void hpu_dma_release(struct hpu_priv *priv)
 {
 	if (priv->dma_rx_chan) {
+		if (priv->rx_desc_reuse)
+			hpu_rx_dma_free_desc(priv);
+		priv->rx_desc_reuse = false;
 		dma_release_channel(priv->dma_rx_chan);
 		hpu_dma_free_pool(priv, &priv->dma_rx_pool, DMA_FROM_DEVICE);
 	}
@@ -1326,6 +4531,10 @@ static void hpu_dma_release(struct hpu_priv *priv)
 		dma_release_channel(priv->dma_tx_chan);
 		hpu_dma_free_pool(priv, &priv->dma_tx_pool, DMA_TO_DEVICE);
 	}
+
+	/* TX completions update it */
+	vfree(priv->ring_ctrl);
+	priv->ring_ctrl = NULL;
 }
 
 static int hpu_dma_alloc_pool(struct hpu_priv *priv,
@@ -1333,44 +4542,54 @@ static int hpu_dma_alloc_pool(struct hpu_priv *priv,
 			      enum dma_data_direction dir)
 {
 	int i;
-#ifndef HPU_DMA_STREAMING
-	hpu_pool->dma_pool = dma_pool_create(HPU_DRIVER_NAME, &priv->pdev->dev,
-					 hpu_pool->ps, 4, 0);
 
-	if (!hpu_pool->dma_pool) {
-		dev_err(&priv->pdev->dev, "Error creating DMA pool\n");
-		return -ENOMEM;
-	}
-#endif
-	hpu_pool->ring = kmalloc(hpu_pool->pn * sizeof(struct hpu_buf), GFP_KERNEL);
+	hpu_pool->ring = kcalloc(hpu_pool->pn, sizeof(struct hpu_buf), GFP_KERNEL);
 	if (!(hpu_pool->ring)) {
 		dev_err(&priv->pdev->dev, "Can't alloc mem for dma ring\n");
 		return -ENOMEM;
 	}
 
-	for (i = 0; i < hpu_pool->pn; i++) {
+	/*
+	 * Allocate the whole ring at once (large allocations are served by
+	 * CMA) and slice it. Buffers are synchronized one by one, so with
+	 * non-coherent memory they must not share cache lines.
+	 */
+	hpu_pool->stride = ALIGN(hpu_pool->ps, dma_get_cache_alignment());
+	hpu_pool->size = PAGE_ALIGN((size_t)hpu_pool->stride * hpu_pool->pn);
 #ifdef HPU_DMA_STREAMING
-	        hpu_pool->ring[i].virt = dma_alloc_noncoherent(&priv->pdev->dev,
-							       hpu_pool->ps,
-							       &hpu_pool->ring[i].phys,
-							       dir, GFP_KERNEL);
+	hpu_pool->virt = dma_alloc_noncoherent(&priv->pdev->dev, hpu_pool->size,
+					       &hpu_pool->phys, dir, GFP_KERNEL);
 #else
-		hpu_pool->ring[i].virt = (unsigned char *)
-			dma_pool_alloc(hpu_pool->dma_pool, GFP_KERNEL,
-				       &hpu_pool->ring[i].phys);
+	hpu_pool->virt = dma_alloc_coherent(&priv->pdev->dev, hpu_pool->size,
+					    &hpu_pool->phys, GFP_KERNEL);
 #endif
-		if (!hpu_pool->ring[i].virt)
+	if (!hpu_pool->virt) {
+		dev_err(&priv->pdev->dev, "Can't alloc %zu bytes of DMA memory\n",
+			hpu_pool->size);
+		return -ENOMEM;
+	}
+
+	if (dir == DMA_TO_DEVICE) {
+		hpu_pool->sg = kcalloc(hpu_pool->pn, sizeof(struct scatterlist),
+				       GFP_KERNEL);
+		if (!hpu_pool->sg) {
+			dev_err(&priv->pdev->dev, "Can't alloc mem for dma sg\n");
 			return -ENOMEM;
+		}
 	}
 
 	for (i = 0; i < hpu_pool->pn; i++) {
+		hpu_pool->ring[i].virt = hpu_pool->virt + i * hpu_pool->stride;
+		hpu_pool->ring[i].phys = hpu_pool->phys + i * hpu_pool->stride;
+		hpu_pool->ring[i].desc = NULL;
 		hpu_pool->ring[i].priv = priv;
 		hpu_pool->ring[i].tail_index = 0;
-		hpu_pool->ring[i].head_index = 0;
 	}
 
 	hpu_pool->buf_index = 0;
 	hpu_pool->filled = 0;
+	hpu_pool->head = 0;
+	hpu_pool->tail = 0;
 
 	return 0;
 }
@@ -1379,25 +4598,20 @@ static void hpu_dma_free_pool(struct hpu_priv *priv,
 			      struct hpu_dma_pool *hpu_pool,
 			      enum dma_data_direction dir)
 {
-	int i;
-
-	for (i = 0; i < hpu_pool->pn; i++) {
+	if (hpu_pool->virt) {
 #ifdef HPU_DMA_STREAMING
-		dma_free_noncoherent(&priv->pdev->dev, hpu_pool->ps, hpu_pool->ring[i].virt,
-				     hpu_pool->ring[i].phys, dir);
+		dma_free_noncoherent(&priv->pdev->dev, hpu_pool->size,
+				     hpu_pool->virt, hpu_pool->phys, dir);
 #else
-		dma_pool_free(hpu_pool->dma_pool,
-			      hpu_pool->ring[i].virt, hpu_pool->ring[i].phys);
+		dma_free_coherent(&priv->pdev->dev, hpu_pool->size,
+				  hpu_pool->virt, hpu_pool->phys);
 #endif
-		hpu_pool->ring[i].virt = NULL;
 	}
-
-#ifndef HPU_DMA_STREAMING
-	dma_pool_destroy(hpu_pool->dma_pool);
-#endif
-	hpu_pool->dma_pool = NULL;
+	hpu_pool->virt = NULL;
 	kfree(hpu_pool->ring);
 	hpu_pool->ring = NULL;
+	kfree(hpu_pool->sg);
+	hpu_pool->sg = NULL;
 }
 
 static void __maybe_unused hpu_rx_dma_thread_terminate(struct hpu_priv *priv)
@@ -1473,26 +4687,43 @@ static int hpu_rx_dma_submit_buffer(struct hpu_priv *priv, struct hpu_buf *buf)
 	struct dma_async_tx_descriptor *dma_desc;
 	dma_cookie_t cookie;
 
-	dma_desc = dmaengine_prep_slave_single(priv->dma_rx_chan,
-					       buf->phys,
-					       priv->dma_rx_pool.ps,
-					       DMA_DEV_TO_MEM,
-					       DMA_CTRL_ACK |
-					       DMA_PREP_INTERRUPT);
+	/* in reuse mode the descriptor is prepared only the first time */
+	dma_desc = buf->desc;
+	if (!dma_desc) {
+		dma_desc = dmaengine_prep_slave_single(priv->dma_rx_chan,
+						       buf->phys,
+						       priv->dma_rx_pool.ps,
+						       DMA_DEV_TO_MEM,
+						       DMA_CTRL_ACK |
+						       DMA_PREP_INTERRUPT);
 
-	if (!dma_desc)
-		return -ENOMEM;
+		if (!dma_desc) {
+			hpu_stats_begin(priv)->rx_submit_errors++;
+			hpu_stats_end(priv);
+			return -ENOMEM;
+		}
 
-	dma_desc->callback_result = hpu_rx_dma_callback;
-	dma_desc->callback_param = buf;
+		dma_desc->callback_result = hpu_rx_dma_callback;
+		dma_desc->callback_param = buf;
+
+		if (priv->rx_desc_reuse) {
+			if (dmaengine_desc_set_reuse(dma_desc))
+				dev_err(&priv->pdev->dev,
+					"Can't set RX DMA descriptor reusable\n");
+			else
+				buf->desc = dma_desc;
+		}
+	}
 #ifdef HPU_DMA_STREAMING
 	dma_sync_single_for_device(&priv->pdev->dev, buf->phys,
 				   priv->dma_rx_pool.ps, DMA_FROM_DEVICE);
 #endif
 	cookie = dmaengine_submit(dma_desc);
 	buf->cookie = cookie;
-	/* this buffer is new and has to be fully read */
-	buf->head_index = 0;
+	if (dma_submit_error(cookie)) {
+		hpu_stats_begin(priv)->rx_submit_errors++;
+		hpu_stats_end(priv);
+	}
 
 	return dma_submit_error(cookie);
 }
@@ -1896,7 +5127,7 @@ static void _hpu_do_set_axis_lat(struct hpu_priv *priv)
 	if (!(priv->ctrl_reg & HPU_CTRL_ENDMA))
 		return;
 
-	lat = priv->clk_rate / 1000 * priv->axis_lat;
+	lat = div_u64((u64)priv->clk_rate * priv->axis_lat_us, 1000000);
 	hpu_reg_write(priv, lat, HPU_TLAST_TIMEOUT);
 }
 
@@ -1909,6 +5140,89 @@ static void hpu_do_set_axis_lat(struct hpu_priv *priv)
 	spin_unlock_irqrestore(&priv->irq_lock, flags);
 }
 
+/*
+ * Adaptive TLAST timeout, much like network adaptive IRQ coalescing.
+ * Periodically look at how many RX buffers have been completed, and how many
+ * of them have been cut short by the TLAST timeout:
+ * - many buffers per second, mostly cut by timeout: we are spending a lot
+ *   in handling small buffers, so raise the timeout to let them fill more.
+ * - few buffers per second, or buffers that fill by size anyway: the timeout
+ *   costs nothing here, so lower it to favour latency (and to be ready in
+ *   case the event rate drops).
+ * Between the two thresholds the timeout is left untouched (hysteresis).
+ */
+static void hpu_rx_coal_work(struct work_struct *work)
+{
+	struct hpu_priv *priv = container_of(to_delayed_work(work),
+					     struct hpu_priv, rx_coal_work);
+	unsigned long pkts, early, rate;
+	unsigned long lat;
+
+	pkts = READ_ONCE(priv->pkt_rxed) - priv->rx_coal_last_pkt;
+	early = READ_ONCE(priv->early_tlast) - priv->rx_coal_last_early;
+	priv->rx_coal_last_pkt += pkts;
+	priv->rx_coal_last_early += early;
+
+	rate = pkts * 1000 / HPU_RX_COAL_PERIOD_MS;
+	lat = priv->axis_lat_us;
+
+	if (rate > HPU_RX_COAL_RATE_HIGH && early * 2 > pkts)
+		lat *= 2;
+	else if (rate < HPU_RX_COAL_RATE_LOW || early * 4 < pkts)
+		lat /= 2;
+	lat = clamp_t(unsigned long, lat, priv->rx_coal_min_us,
+		      priv->rx_coal_max_us);
+
+	if (lat != priv->axis_lat_us) {
+		dev_dbg(&priv->pdev->dev,
+			"RX adaptive latency %lu uS (%lu buf/s, %lu early)\n",
+			lat, rate, early);
+		priv->axis_lat_us = lat;
+		hpu_do_set_axis_lat(priv);
+	}
+
+	schedule_delayed_work(&priv->rx_coal_work,
+			      msecs_to_jiffies(HPU_RX_COAL_PERIOD_MS));
+}
+
+static void hpu_rx_coal_stop(struct hpu_priv *priv)
+{
+	priv->rx_coal_enable = false;
+	cancel_delayed_work_sync(&priv->rx_coal_work);
+}
+
+static int hpu_set_axis_lat_adaptive(struct hpu_priv *priv,
+				     hpu_axis_lat_adaptive_t *cfg)
+{
+	/* a bad setting leaves the current one alone */
+	if (cfg->enable &&
+	    (!cfg->min_us || cfg->min_us > cfg->max_us ||
+	     cfg->max_us > HPU_RX_COAL_MAX_US))
+		return -EINVAL;
+
+	hpu_rx_coal_stop(priv);
+
+	if (!cfg->enable)
+		return 0;
+
+	priv->rx_coal_min_us = cfg->min_us;
+	priv->rx_coal_max_us = cfg->max_us;
+	priv->rx_coal_last_pkt = READ_ONCE(priv->pkt_rxed);
+	priv->rx_coal_last_early = READ_ONCE(priv->early_tlast);
+
+	mutex_lock(&priv->dma_rx_pool.mutex_lock);
+	priv->axis_lat_us = clamp_t(unsigned long, priv->axis_lat_us,
+				    cfg->min_us, cfg->max_us);
+	hpu_do_set_axis_lat(priv);
+	mutex_unlock(&priv->dma_rx_pool.mutex_lock);
+
+	priv->rx_coal_enable = true;
+	schedule_delayed_work(&priv->rx_coal_work,
+			      msecs_to_jiffies(HPU_RX_COAL_PERIOD_MS));
+
+	return 0;
+}
+
 static void hpu_set_aux_thrs(struct hpu_priv *priv, aux_cnt_t aux_cnt_reg)
 {
 	unsigned int reg;
@@ -1954,10 +5268,25 @@ static int hpu_set_timestamp(struct hpu_priv *priv, unsigned int val)
 		priv->ctrl_reg &= ~HPU_CTRL_FULLTS;
 
 	hpu_reg_write(priv, priv->ctrl_reg, HPU_CTRL_REG);
+	/* timestamps can't be unwrapped across the change */
+	priv->rx_ts_gen++;
 	spin_unlock_irqrestore(&priv->irq_lock, flags);
 	return 0;
 }
 
+static void hpu_clear_timestamp(struct hpu_priv *priv)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&priv->irq_lock, flags);
+	/* this clears the timestamp counter, too: it's just like a wrap */
+	hpu_reg_write(priv, 0, HPU_WRAP_REG);
+	priv->rx_wraps = 0;
+	priv->rx_wrap_time = ktime_get();
+	priv->rx_ts_gen++;
+	spin_unlock_irqrestore(&priv->irq_lock, flags);
+}
+
 static void hpu_get_hw_status(struct hpu_priv *priv, hpu_hw_status_t *status)
 {
 	u32 reg = hpu_reg_read(priv, HPU_RAWSTAT_REG);
@@ -2017,60 +5346,370 @@ static void hpu_get_hw_status(struct hpu_priv *priv, hpu_hw_status_t *status)
 	if (reg & HPU_RAWSTAT_LSPINN_PARITY_ERR)
 		status->lspinn_parity_err = 1;
 
-	if (reg & HPU_RAWSTAT_RSPINN_PARITY_ERR)
-		status->rspinn_parity_err = 1;
+	if (reg & HPU_RAWSTAT_RSPINN_PARITY_ERR)
+		status->rspinn_parity_err = 1;
+
+	if (reg & HPU_RAWSTAT_AUXSPINN_PARITY_ERR)
+		status->auxspinn_parity_err = 1;
+}
+
+static int hpu_set_rx_ts_enable(struct hpu_priv *priv, unsigned int val)
+{
+	unsigned long flags;
+
+	/* some reader needs RX timestamps to be unwrapped */
+	if (!val && priv->rx_unwrap_nr)
+		return -EBUSY;
+
+	spin_lock_irqsave(&priv->irq_lock, flags);
+	priv->rx_ts_disable = !val;
+	if (val)
+		priv->ctrl_reg &= ~HPU_CTRL_DISABLE_RX_TS;
+	else
+		priv->ctrl_reg |= HPU_CTRL_DISABLE_RX_TS;
+	hpu_reg_write(priv, priv->ctrl_reg, HPU_CTRL_REG);
+	spin_unlock_irqrestore(&priv->irq_lock, flags);
+
+	return 0;
+}
+
+/*
+ * Select the format in which read() returns RX data to a reader. Events are
+ * converted one by one, so they must carry a timestamp and the reader can't
+ * be in the middle of one (RX_FORMAT_DELTA converts whole buffers, so not
+ * in the middle of a buffer either); readers sharing the RX buffers get
+ * them as they are. Must be called with RX lock held.
+ */
+static int hpu_set_rx_format(struct hpu_file *hf, unsigned int format)
+{
+	struct hpu_priv *priv = hf->priv;
+
+	if (format > RX_FORMAT_DELTA)
+		return -EINVAL;
+
+	if (format == hf->rx_format)
+		return 0;
+
+	/* staged buffers are read with their own offsets */
+	if ((format == RX_FORMAT_DELTA || hpu_rx_needs_stage(hf)) &&
+	    hf->rx_offs)
+		return -EBUSY;
+
+	if (format == RX_FORMAT_RAW) {
+		WRITE_ONCE(priv->rx_unwrap_nr, priv->rx_unwrap_nr - 1);
+	} else if (hf->rx_format == RX_FORMAT_RAW) {
+		if (priv->rx_ts_disable)
+			return -EINVAL;
+		if (hf->rx_share || hf->rx_offs % 8)
+			return -EBUSY;
+
+		/* best guess for the buffers received before now */
+		hf->rx_ts_valid = false;
+		hf->rx_ts_epoch = hpu_reg_read(priv, HPU_WRAP_REG);
+		WRITE_ONCE(priv->rx_unwrap_nr, priv->rx_unwrap_nr + 1);
+	}
+	hf->rx_format = format;
+	hf->rx_staged = false;
+
+	return 0;
+}
+
+/*
+ * Select the sources of the RX events that read() returns to a reader; the
+ * others are skipped. Readers sharing the RX buffers get all of them.
+ * Must be called with RX lock held.
+ */
+static int hpu_set_rx_sources(struct hpu_file *hf, unsigned int sources)
+{
+	if (!sources || (sources & ~HPU_RX_SRC_ALL))
+		return -EINVAL;
+
+	if (sources == hf->rx_src_mask)
+		return 0;
+
+	/* staged buffers are read with their own offsets */
+	if (hf->rx_share || hf->rx_offs)
+		return -EBUSY;
+
+	hf->rx_src_mask = sources;
+	hf->rx_staged = false;
 
-	if (reg & HPU_RAWSTAT_AUXSPINN_PARITY_ERR)
-		status->auxspinn_parity_err = 1;
+	return 0;
 }
 
-static int hpu_set_rx_ts_enable(struct hpu_priv *priv, unsigned int val)
+static int hpu_set_tx_ts_enable(struct hpu_priv *priv, unsigned int val)
 {
 	unsigned long flags;
 
 	spin_lock_irqsave(&priv->irq_lock, flags);
-	priv->rx_ts_disable = !val;
 	if (val)
-		priv->ctrl_reg &= ~HPU_CTRL_DISABLE_RX_TS;
+		priv->ctrl_reg &= ~HPU_CTRL_DISABLE_TX_TS;
 	else
-		priv->ctrl_reg |= HPU_CTRL_DISABLE_RX_TS;
+		priv->ctrl_reg |= HPU_CTRL_DISABLE_TX_TS;
+
 	hpu_reg_write(priv, priv->ctrl_reg, HPU_CTRL_REG);
 	spin_unlock_irqrestore(&priv->irq_lock, flags);
 
 	return 0;
 }
 
-static int hpu_set_tx_ts_enable(struct hpu_priv *priv, unsigned int val)
+static hpu_ring_ctrl_t *hpu_alloc_ring_ctrl(struct hpu_priv *priv,
+					    struct hpu_dma_pool *rx_pool,
+					    struct hpu_dma_pool *tx_pool)
+{
+	hpu_ring_ctrl_t *ring_ctrl;
+
+	ring_ctrl = vmalloc_user(PAGE_ALIGN(sizeof(hpu_ring_ctrl_t) +
+					    rx_pool->pn * sizeof(u32)));
+	if (!ring_ctrl) {
+		dev_err(&priv->pdev->dev,
+			"Error allocating memory for ring control area\n");
+		return NULL;
+	}
+	ring_ctrl->rx_pn = rx_pool->pn;
+	ring_ctrl->rx_ps = rx_pool->ps;
+	ring_ctrl->rx_stride = rx_pool->stride;
+	ring_ctrl->tx_pn = tx_pool->pn;
+	ring_ctrl->tx_ps = tx_pool->ps;
+	ring_ctrl->tx_stride = tx_pool->stride;
+
+	return ring_ctrl;
+}
+
+/* Exchange the memory (and the state that depends on it) of two pools */
+static void hpu_dma_swap_pool(struct hpu_dma_pool *a, struct hpu_dma_pool *b)
+{
+	swap(a->virt, b->virt);
+	swap(a->phys, b->phys);
+	swap(a->size, b->size);
+	swap(a->stride, b->stride);
+	swap(a->ring, b->ring);
+	swap(a->sg, b->sg);
+	swap(a->ps, b->ps);
+	swap(a->pn, b->pn);
+	swap(a->buf_index, b->buf_index);
+	swap(a->filled, b->filled);
+	swap(a->head, b->head);
+	swap(a->tail, b->tail);
+}
+
+static bool hpu_geometry_valid(u32 ps, u32 pn, u32 max_ps)
 {
+	return ps && !(ps % 8) && ps <= max_ps &&
+		is_power_of_2(pn) && pn >= 2 && pn <= HPU_RING_MAX_PN &&
+		(u64)pn * ps <= HPU_RING_MAX_SIZE;
+}
+
+/*
+ * Change the RX/TX rings geometry without closing the device. The new rings
+ * are allocated before touching anything, so that on failure the old ones
+ * are still there; then the RX path is flushed and the DMA is stopped, the
+ * rings are exchanged and everything is restarted.
+ * Must be called with access lock held.
+ */
+static int hpu_set_ring_geometry(struct hpu_priv *priv,
+				 hpu_ring_geometry_t *geo)
+{
+	struct hpu_dma_pool rx_pool = {}, tx_pool = {};
+	hpu_ring_ctrl_t *ring_ctrl;
+	struct hpu_file *hf;
 	unsigned long flags;
+	int was_suspended;
+	int ret;
+	u32 reg;
+
+	if (!geo->rx_ps)
+		geo->rx_ps = priv->dma_rx_pool.ps;
+	if (!geo->rx_pn)
+		geo->rx_pn = priv->dma_rx_pool.pn;
+	if (!hpu_geometry_valid(geo->rx_ps, geo->rx_pn,
+				 HPU_DMA_LENGTH_MASK * 4))
+		return -EINVAL;
+
+	if (priv->dma_tx_chan) {
+		if (!geo->tx_ps)
+			geo->tx_ps = priv->dma_tx_pool.ps;
+		if (!geo->tx_pn)
+			geo->tx_pn = priv->dma_tx_pool.pn;
+		if (!hpu_geometry_valid(geo->tx_ps, geo->tx_pn, INT_MAX))
+			return -EINVAL;
+	}
+
+	rx_pool.ps = geo->rx_ps;
+	rx_pool.pn = geo->rx_pn;
+	ret = hpu_dma_alloc_pool(priv, &rx_pool, DMA_FROM_DEVICE);
+	if (ret)
+		goto err_free_rx;
+
+	if (priv->dma_tx_chan) {
+		tx_pool.ps = geo->tx_ps;
+		tx_pool.pn = geo->tx_pn;
+		ret = hpu_dma_alloc_pool(priv, &tx_pool, DMA_TO_DEVICE);
+		if (ret)
+			goto err_free_tx;
+	}
+
+	ring_ctrl = hpu_alloc_ring_ctrl(priv, &rx_pool, &tx_pool);
+	if (!ring_ctrl) {
+		ret = -ENOMEM;
+		goto err_free_tx;
+	}
+
+	/*
+	 * userspace still has the old rings mapped, or a TX pattern is on;
+	 * map_lock keeps mmap() out until the old rings are gone
+	 */
+	mutex_lock(&priv->map_lock);
+	if (atomic_read(&priv->rx_ring_mapped) ||
+	    atomic_read(&priv->tx_ring_mapped) ||
+	    atomic_read(&priv->ctrl_mapped) ||
+	    READ_ONCE(priv->tx_pattern_on)) {
+		ret = -EBUSY;
+		goto err_unlock;
+	}
 
+	mutex_lock(&priv->dma_rx_pool.mutex_lock);
+	mutex_lock(&priv->dma_tx_pool.mutex_lock);
+
+	/* quiesce: no more RX data in, whatever is in flight is dropped */
 	spin_lock_irqsave(&priv->irq_lock, flags);
-	if (val)
-		priv->ctrl_reg &= ~HPU_CTRL_DISABLE_TX_TS;
-	else
-		priv->ctrl_reg |= HPU_CTRL_DISABLE_TX_TS;
+	was_suspended = priv->rx_suspended;
+	hpu_rx_suspend(priv);
+	spin_unlock_irqrestore(&priv->irq_lock, flags);
 
-	hpu_reg_write(priv, priv->ctrl_reg, HPU_CTRL_REG);
+	hpu_flush_rx(priv, false);
+	if (priv->dma_tx_chan) {
+		hpu_tx_wc_flush(priv);
+		ret = hpu_tx_wait_idle(priv);
+		if (ret) {
+			/* the DMA is still running on the old rings: keep them */
+			spin_lock_irqsave(&priv->irq_lock, flags);
+			if (!was_suspended)
+				hpu_rx_resume(priv);
+			spin_unlock_irqrestore(&priv->irq_lock, flags);
+			mutex_unlock(&priv->dma_tx_pool.mutex_lock);
+			mutex_unlock(&priv->dma_rx_pool.mutex_lock);
+			goto err_unlock;
+		}
+	}
+	hpu_stop_dma(priv);
+
+#ifdef HPU_DMA_DEFER_SUBMIT
+	hpu_rx_dma_thread_terminate(priv);
+#endif
+	if (priv->rx_desc_reuse)
+		hpu_rx_dma_free_desc(priv);
+	dmaengine_terminate_sync(priv->dma_rx_chan);
+	if (priv->dma_tx_chan)
+		dmaengine_terminate_sync(priv->dma_tx_chan);
+
+	hpu_dma_swap_pool(&priv->dma_rx_pool, &rx_pool);
+	if (priv->dma_tx_chan)
+		hpu_dma_swap_pool(&priv->dma_tx_pool, &tx_pool);
+	swap(priv->ring_ctrl, ring_ctrl);
+	vfree(ring_ctrl);
+	list_for_each_entry(hf, &priv->rx_readers, node) {
+		hpu_rx_reader_reset(hf, 0);
+		hf->rx_claimed = 0;
+	}
+	priv->rx_share_claim = 0;
+	priv->rx_share_done = 0;
+
+	reinit_completion(&priv->dma_rx_pool.completion);
+	reinit_completion(&priv->dma_tx_pool.completion);
+
+	/* restart, much like open() does */
+#ifdef HPU_DMA_DEFER_SUBMIT
+	hpu_rx_dma_thread_create(priv);
+#endif
+	ret = hpu_rx_dma_submit_pool(priv);
+	if (ret)
+		dev_err(&priv->pdev->dev,
+			"Error in submitting RX DMA descriptor\n");
+	dma_async_issue_pending(priv->dma_rx_chan);
+
+	priv->rx_tlast_count = hpu_reg_read(priv, HPU_TLAST_COUNT) >> 16;
+	priv->rx_data_count = hpu_reg_read(priv, HPU_DATA_COUNT) >> 16;
+
+	reg = priv->dma_rx_pool.ps / 4;
+	if (test_dma)
+		reg |= HPU_DMA_TEST_ON;
+	hpu_reg_write(priv, reg, HPU_DMA_REG);
+
+	hpu_start_dma(priv);
+
+	spin_lock_irqsave(&priv->irq_lock, flags);
+	if (!was_suspended)
+		hpu_rx_resume(priv);
 	spin_unlock_irqrestore(&priv->irq_lock, flags);
 
-	return 0;
+	mutex_unlock(&priv->dma_tx_pool.mutex_lock);
+	mutex_unlock(&priv->dma_rx_pool.mutex_lock);
+	mutex_unlock(&priv->map_lock);
+
+	/* now they hold the old rings */
+	hpu_dma_free_pool(priv, &tx_pool, DMA_TO_DEVICE);
+	hpu_dma_free_pool(priv, &rx_pool, DMA_FROM_DEVICE);
+
+	return ret;
+
+err_unlock:
+	mutex_unlock(&priv->map_lock);
+	vfree(ring_ctrl);
+	hpu_dma_free_pool(priv, &tx_pool, DMA_TO_DEVICE);
+	hpu_dma_free_pool(priv, &rx_pool, DMA_FROM_DEVICE);
+
+	return ret;
+
+err_free_tx:
+	hpu_dma_free_pool(priv, &tx_pool, DMA_TO_DEVICE);
+err_free_rx:
+	hpu_dma_free_pool(priv, &rx_pool, DMA_FROM_DEVICE);
+	dev_err(&priv->pdev->dev, "Error allocating memory for new rings\n");
+
+	return ret;
 }
 
 static int hpu_chardev_open(struct inode *i, struct file *f)
 {
 	int ret = 0;
 	u32 reg;
+	struct hpu_file *hf;
 	struct hpu_priv *priv = container_of(i->i_cdev,
 					     struct hpu_priv, cdev);
 
-	f->private_data = priv;
+	hf = kzalloc(sizeof(*hf), GFP_KERNEL);
+	if (!hf)
+		return -ENOMEM;
+	hf->priv = priv;
+	hf->rx_src_mask = HPU_RX_SRC_ALL;
+	atomic_set(&hf->rx_ring_mapped, 0);
+
+	f->private_data = hf;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0)
+	/* read_iter/write_iter honour IOCB_NOWAIT */
+	f->f_mode |= FMODE_NOWAIT;
+#endif
 
 	mutex_lock(&priv->access_lock);
-	if (priv->hpu_is_opened == 1) {
+	if (priv->hpu_is_opened >= max(max_readers, 1)) {
 		mutex_unlock(&priv->access_lock);
+		kfree(hf);
 		return -EBUSY;
 	}
 
+	/* already up and running: just add one more reader, starting from now */
+	if (priv->hpu_is_opened) {
+		mutex_lock(&priv->dma_rx_pool.mutex_lock);
+		hf->rx_cursor = smp_load_acquire(&priv->dma_rx_pool.head);
+		list_add_tail(&hf->node, &priv->rx_readers);
+		WRITE_ONCE(priv->rx_nreaders, priv->rx_nreaders + 1);
+		mutex_unlock(&priv->dma_rx_pool.mutex_lock);
+		priv->hpu_is_opened++;
+		mutex_unlock(&priv->access_lock);
+		return 0;
+	}
+
 #ifdef HPU_DMA_DEFER_SUBMIT
 	hpu_rx_dma_thread_create(priv);
 #endif
@@ -2078,20 +5717,45 @@ static int hpu_chardev_open(struct inode *i, struct file *f)
 
 	priv->rx_blocking_threshold = ~0;
 	priv->tx_blocking_threshold = ~0;
+	priv->tx_max_chain = 0;
+	priv->tx_zc_thr = 0;
+	priv->tx_wc_us = 0;
+	priv->tx_wc_len = 0;
+	priv->tx_unissued_time = 0;
+	memset(&priv->tx_lat_stats, 0, sizeof(priv->tx_lat_stats));
+	priv->tx_bytes_done = 0;
 	priv->pkt_txed = 0;
 	priv->byte_txed = 0;
 	priv->pkt_rxed = 0;
 	priv->byte_rxed = 0;
 	priv->early_tlast = 0;
 	priv->rx_fifo_status = FIFO_OK;
-	priv->axis_lat = 10; /* mS */
+	priv->axis_lat_us = 10000;
+	priv->rx_coal_enable = false;
+	priv->rx_busy_poll_us = 0;
+	priv->rx_seq = 0;
+	priv->rx_max_lag = 0;
+	priv->rx_share_nr = 0;
+	priv->rx_share_claim = 0;
+	priv->rx_share_done = 0;
+	priv->rx_share_gap = 0;
+	priv->rx_unwrap_nr = 0;
+	priv->rx_wrap_time = 0;
+	priv->rx_ts_gen = 0;
+	priv->rx_overflow_recovery = false;
+	priv->rx_gap_pending = false;
+	priv->rx_overflows = 0;
+	priv->rx_fifo_overflows = 0;
+	priv->rx_bytes_produced = 0;
+	priv->rx_bytes_delivered = 0;
+	memset(priv->rx_bytes_lost, 0, sizeof(priv->rx_bytes_lost));
+	priv->rx_loss_overflow = false;
+	memset(&priv->rx_wakeup_stats, 0, sizeof(priv->rx_wakeup_stats));
 
 	priv->hpu_is_opened = 1;
 	ret = hpu_dma_init(priv);
-	if (ret) {
-		mutex_unlock(&priv->access_lock);
-		return ret;
-	}
+	if (ret)
+		goto err_opened;
 
 	if (priv->dma_tx_chan) {
 		priv->dma_tx_pool.ps = tx_ps;
@@ -2119,6 +5783,25 @@ static int hpu_chardev_open(struct inode *i, struct file *f)
 		goto err_dealloc_dma;
 	}
 
+	priv->ring_ctrl = hpu_alloc_ring_ctrl(priv, &priv->dma_rx_pool,
+					      &priv->dma_tx_pool);
+	if (!priv->ring_ctrl) {
+		ret = -ENOMEM;
+		goto err_dealloc_dma;
+	}
+
+	priv->rx_desc_reuse = false;
+	if (rx_reuse) {
+		struct dma_slave_caps caps;
+
+		if (!dma_get_slave_caps(priv->dma_rx_chan, &caps) &&
+		    caps.descriptor_reuse)
+			priv->rx_desc_reuse = true;
+		else
+			dev_notice(&priv->pdev->dev,
+				   "RX DMA descriptor reuse not supported by DMA driver\n");
+	}
+
 	ret = hpu_rx_dma_submit_pool(priv);
 	if (ret) {
 		dev_err(&priv->pdev->dev,
@@ -2168,9 +5851,11 @@ static int hpu_chardev_open(struct inode *i, struct file *f)
 	if (test_dma)
 		priv->irq_msk = 0;
 	else
-		/* Unmask RXFIFOFULL interrupt */
-		priv->irq_msk = HPU_MSK_INT_RXFIFOFULL;
+		/* Unmask RXFIFOFULL and timestamp wrap interrupts */
+		priv->irq_msk = HPU_MSK_INT_RXFIFOFULL |
+			HPU_MSK_INT_TSTAMPWRAPPED;
 
+	priv->rx_wraps = hpu_reg_read(priv, HPU_WRAP_REG);
 	hpu_reg_write(priv, priv->irq_msk, HPU_IRQMASK_REG);
 	/* clear all INTs */
 	hpu_reg_write(priv, 0xffffffff, HPU_IRQ_REG);
@@ -2178,6 +5863,11 @@ static int hpu_chardev_open(struct inode *i, struct file *f)
 	priv->ctrl_reg |= HPU_CTRL_ENINT | HPU_CTRL_AXIS_LAT;
 	hpu_reg_write(priv, priv->ctrl_reg, HPU_CTRL_REG);
 
+	/* the RX ring is empty: start reading from its beginning */
+	hf->rx_cursor = 0;
+	list_add_tail(&hf->node, &priv->rx_readers);
+	priv->rx_nreaders = 1;
+
 	/* this will also set TLAST timeout */
 	hpu_start_dma(priv);
 
@@ -2186,19 +5876,53 @@ static int hpu_chardev_open(struct inode *i, struct file *f)
 
 err_dealloc_dma:
 	hpu_dma_release(priv);
+err_opened:
+	priv->hpu_is_opened = 0;
 	mutex_unlock(&priv->access_lock);
+	kfree(hf);
 
 	return ret;
 }
 
 static int hpu_chardev_close(struct inode *i, struct file *fp)
 {
-	struct hpu_priv *priv = fp->private_data;
+	struct hpu_file *hf = fp->private_data;
+	struct hpu_priv *priv = hf->priv;
 	unsigned long flags;
 
 	mutex_lock(&priv->access_lock);
+	if (hf->rx_format != RX_FORMAT_RAW)
+		WRITE_ONCE(priv->rx_unwrap_nr, priv->rx_unwrap_nr - 1);
+	kvfree(hf->rx_stage);
+
+	/* other readers are still there: just stop holding RX buffers back */
+	if (priv->hpu_is_opened > 1) {
+		mutex_lock(&priv->dma_rx_pool.mutex_lock);
+		hpu_rx_share_leave(hf);
+		list_del(&hf->node);
+		WRITE_ONCE(priv->rx_nreaders, priv->rx_nreaders - 1);
+		hpu_rx_readers_release(priv);
+		mutex_unlock(&priv->dma_rx_pool.mutex_lock);
+		priv->hpu_is_opened--;
+		mutex_unlock(&priv->access_lock);
+		kfree(hf);
+		return 0;
+	}
+
+	hpu_rx_coal_stop(priv);
+	hrtimer_cancel(&priv->tx_wc_timer);
+	cancel_work_sync(&priv->tx_wc_work);
+	hrtimer_cancel(&priv->tx_queue_timer);
+	cancel_work_sync(&priv->tx_queue_work);
+	if (priv->dma_tx_chan)
+		hpu_set_tx_eventfd(priv, -1);
 	mutex_lock(&priv->dma_rx_pool.mutex_lock);
 	mutex_lock(&priv->dma_tx_pool.mutex_lock);
+	if (priv->dma_tx_chan) {
+		hpu_tx_pattern_stop(priv);
+		hpu_tx_queue_free(priv);
+		hpu_tx_wc_flush(priv);
+	}
 
 	spin_lock_irqsave(&priv->irq_lock, flags);
 	/* Disable RX */
@@ -2210,6 +5934,8 @@ static int hpu_chardev_close(struct inode *i, struct file *fp)
 	/* Mask interrupts - this ensure that pending IRQ are ignored by ISR */
 	priv->irq_msk = 0;
 	hpu_reg_write(priv, priv->irq_msk, HPU_IRQMASK_REG);
+	/* make any pending RX housekeeping do nothing */
+	WRITE_ONCE(priv->rx_fifo_status, FIFO_OK);
 	spin_unlock_irqrestore(&priv->irq_lock, flags);
 
 	/* Disable interrupts */
@@ -2236,10 +5962,13 @@ static int hpu_chardev_close(struct inode *i, struct file *fp)
 	dmaengine_terminate_sync(priv->dma_tx_chan);
 
 	hpu_dma_release(priv);
+	list_del(&hf->node);
+	priv->rx_nreaders = 0;
 	priv->hpu_is_opened = 0;
 	hpu_clk_disable(priv);
 
 	mutex_unlock(&priv->access_lock);
+	kfree(hf);
 
 	return 0;
 }
@@ -2299,6 +6028,9 @@ static irqreturn_t hpu_irq_handler(int irq, void *pdev)
 
 	if (intr & HPU_MSK_INT_TSTAMPWRAPPED) {
 		hpu_reg_write(priv, HPU_MSK_INT_TSTAMPWRAPPED, HPU_IRQ_REG);
+		/* see hpu_rx_ts_snapshot() */
+		priv->rx_wraps = hpu_reg_read(priv, HPU_WRAP_REG);
+		priv->rx_wrap_time = ktime_get();
 		retval = IRQ_HANDLED;
 	}
 
@@ -2326,7 +6058,10 @@ static irqreturn_t hpu_irq_handler(int irq, void *pdev)
 
 		/* Clear fifo-full interrupt */
 		hpu_reg_write(priv, HPU_MSK_INT_RXFIFOFULL, HPU_IRQ_REG);
-		WRITE_ONCE(priv->rx_fifo_status, FIFO_OVERFLOW);
+		priv->rx_fifo_overflows++;
+		WRITE_ONCE(priv->rx_fifo_status, priv->rx_overflow_recovery ?
+			   FIFO_RECOVERING : FIFO_OVERFLOW);
+		wake_up_interruptible(&priv->dma_rx_pool.poll_wq);
 
 		/* Schedule the rx-purger thread */
 		schedule_work(&priv->rx_housekeeping_work);
@@ -2385,12 +6120,38 @@ static long hpu_ioctl(struct file *fp, unsigned int cmd, unsigned long _arg)
 	hpu_tx_resync_time_t resync_time;
 	hpu_hw_status_t hw_status;
 	spinn_keys_enable_t keys_enable;
+	hpu_rx_ring_sync_t ring_sync;
+	hpu_axis_lat_adaptive_t lat_adaptive;
+	hpu_rx_wakeup_stats_t wakeup_stats;
+	hpu_rx_loss_stats_t loss_stats;
+	hpu_ring_geometry_t geometry;
+	hpu_tx_ring_submit_t tx_submit;
+	hpu_tx_dma_cfg_t tx_dma_cfg;
+	hpu_tx_issue_policy_t issue_policy;
+	hpu_tx_lat_stats_t lat_stats;
+	hpu_tx_queue_cfg_t queue_cfg;
+	hpu_tx_pattern_t pattern;
+	hpu_tx_pattern_stats_t pattern_stats;
+	u64 bytes;
+	int fd;
 	unsigned int val = 0;
 	int res = 0;
-	struct hpu_priv *priv = fp->private_data;
+	struct hpu_file *hf = fp->private_data;
+	struct hpu_priv *priv = hf->priv;
 
 	dev_dbg(&priv->pdev->dev, "ioctl %x\n", cmd);
 
+	/* this may block waiting for data: don't hold the access lock */
+	if (cmd == _IOWR(0x0, HPU_IOCTL_RX_RING_SYNC, hpu_rx_ring_sync_t *)) {
+		if (copy_from_user(&ring_sync, arg, sizeof(hpu_rx_ring_sync_t)))
+			return -EFAULT;
+		res = hpu_rx_ring_sync(hf, &ring_sync,
+				       fp->f_flags & O_NONBLOCK);
+		if (copy_to_user(arg, &ring_sync, sizeof(hpu_rx_ring_sync_t)))
+			return -EFAULT;
+		return res;
+	}
+
 	mutex_lock(&priv->access_lock);
 	switch (cmd) {
 	case _IOR(0x0, HPU_IOCTL_READTIMESTAMP, unsigned int):
@@ -2400,7 +6161,7 @@ static long hpu_ioctl(struct file *fp, unsigned int cmd, unsigned long _arg)
 		break;
 
 	case _IOW(0x0, HPU_IOCTL_CLEARTIMESTAMP, unsigned int):
-		hpu_reg_write(priv, 0, HPU_WRAP_REG);
+		hpu_clear_timestamp(priv);
 		break;
 
 	case _IOR(0x0, HPU_IOCTL_READVERSION, unsigned int *):
@@ -2532,12 +6293,57 @@ static long hpu_ioctl(struct file *fp, unsigned int cmd, unsigned long _arg)
 	case _IOW(0x0, HPU_IOCTL_SET_AXIS_LATENCY, unsigned int *):
 		if (copy_from_user(&val, arg, sizeof(unsigned int)))
 			goto cfuser_err;
+		/* it must fit the TLAST timeout register, in clock cycles */
+		if (val > HPU_AXIS_LAT_MAX_MS ||
+		    div_u64((u64)priv->clk_rate * val, 1000) > U32_MAX) {
+			res = -EINVAL;
+			break;
+		}
+		/* a fixed latency disables the adaptive mode */
+		hpu_rx_coal_stop(priv);
 		mutex_lock(&priv->dma_rx_pool.mutex_lock);
-		priv->axis_lat = val;
+		priv->axis_lat_us = val * 1000UL;
 		hpu_do_set_axis_lat(priv);
 		mutex_unlock(&priv->dma_rx_pool.mutex_lock);
 		break;
 
+	case _IOW(0x0, HPU_IOCTL_SET_AXIS_LATENCY_ADAPTIVE, hpu_axis_lat_adaptive_t *):
+		if (copy_from_user(&lat_adaptive, arg,
+				   sizeof(hpu_axis_lat_adaptive_t)))
+			goto cfuser_err;
+		res = hpu_set_axis_lat_adaptive(priv, &lat_adaptive);
+		break;
+
+	case _IOW(0x0, HPU_IOCTL_SET_RX_BUSY_POLL, unsigned int *):
+		if (copy_from_user(&val, arg, sizeof(unsigned int)))
+			goto cfuser_err;
+		if (val > HPU_RX_BUSY_POLL_MAX_US) {
+			res = -EINVAL;
+			break;
+		}
+		/* stats restart, so that they refer to the new setting */
+		mutex_lock(&priv->dma_rx_pool.mutex_lock);
+		priv->rx_busy_poll_us = val;
+		memset(&priv->rx_wakeup_stats, 0, sizeof(priv->rx_wakeup_stats));
+		mutex_unlock(&priv->dma_rx_pool.mutex_lock);
+		break;
+
+	case _IOR(0x0, HPU_IOCTL_GET_RX_WAKEUP_STATS, hpu_rx_wakeup_stats_t *):
+		mutex_lock(&priv->dma_rx_pool.mutex_lock);
+		wakeup_stats = priv->rx_wakeup_stats;
+		mutex_unlock(&priv->dma_rx_pool.mutex_lock);
+		if (copy_to_user(arg, &wakeup_stats, sizeof(hpu_rx_wakeup_stats_t)))
+			goto cfuser_err;
+		break;
+
+	case _IOR(0x0, HPU_IOCTL_GET_RX_LOSS_STATS, hpu_rx_loss_stats_t *):
+		mutex_lock(&priv->dma_rx_pool.mutex_lock);
+		hpu_get_rx_loss_stats(priv, &loss_stats);
+		mutex_unlock(&priv->dma_rx_pool.mutex_lock);
+		if (copy_to_user(arg, &loss_stats, sizeof(hpu_rx_loss_stats_t)))
+			goto cfuser_err;
+		break;
+
 	case _IOR(0x0, HPU_IOCTL_GET_RX_PN, unsigned int *):
 		ret = priv->dma_rx_pool.pn;
 		if (copy_to_user(arg, &ret, sizeof(unsigned int)))
@@ -2611,6 +6417,171 @@ static long hpu_ioctl(struct file *fp, unsigned int cmd, unsigned long _arg)
 		res = hpu_set_rx_ts_enable(priv, val);
 		break;
 
+	case _IOW(0x0, HPU_IOCTL_SET_RX_META, unsigned int *):
+		if (copy_from_user(&val, arg, sizeof(unsigned int)))
+			goto cfuser_err;
+		mutex_lock(&priv->dma_rx_pool.mutex_lock);
+		hf->rx_meta = !!val;
+		mutex_unlock(&priv->dma_rx_pool.mutex_lock);
+		break;
+
+	case _IOWR(0x0, HPU_IOCTL_SET_RING_GEOMETRY, hpu_ring_geometry_t *):
+		if (copy_from_user(&geometry, arg, sizeof(hpu_ring_geometry_t)))
+			goto cfuser_err;
+		res = hpu_set_ring_geometry(priv, &geometry);
+		if (copy_to_user(arg, &geometry, sizeof(hpu_ring_geometry_t)))
+			goto cfuser_err;
+		break;
+
+	case _IOW(0x0, HPU_IOCTL_SET_RX_OVERFLOW_RECOVERY, unsigned int *):
+		if (copy_from_user(&val, arg, sizeof(unsigned int)))
+			goto cfuser_err;
+		mutex_lock(&priv->dma_rx_pool.mutex_lock);
+		priv->rx_overflow_recovery = !!val;
+		mutex_unlock(&priv->dma_rx_pool.mutex_lock);
+		break;
+
+	case _IOW(0x0, HPU_IOCTL_SET_RX_SHARE, unsigned int *):
+		if (copy_from_user(&val, arg, sizeof(unsigned int)))
+			goto cfuser_err;
+		mutex_lock(&priv->dma_rx_pool.mutex_lock);
+		if (val && (hf->rx_format != RX_FORMAT_RAW ||
+			    hf->rx_src_mask != HPU_RX_SRC_ALL))
+			res = -EBUSY;
+		else if (val)
+			hpu_rx_share_join(hf);
+		else
+			hpu_rx_share_leave(hf);
+		mutex_unlock(&priv->dma_rx_pool.mutex_lock);
+		break;
+
+	case _IOW(0x0, HPU_IOCTL_SET_RX_FORMAT, unsigned int *):
+		if (copy_from_user(&val, arg, sizeof(unsigned int)))
+			goto cfuser_err;
+		mutex_lock(&priv->dma_rx_pool.mutex_lock);
+		res = hpu_set_rx_format(hf, val);
+		mutex_unlock(&priv->dma_rx_pool.mutex_lock);
+		break;
+
+	case _IOW(0x0, HPU_IOCTL_SET_RX_SOURCES, unsigned int *):
+		if (copy_from_user(&val, arg, sizeof(unsigned int)))
+			goto cfuser_err;
+		mutex_lock(&priv->dma_rx_pool.mutex_lock);
+		res = hpu_set_rx_sources(hf, val);
+		mutex_unlock(&priv->dma_rx_pool.mutex_lock);
+		break;
+
+	case _IOW(0x0, HPU_IOCTL_TX_RING_SUBMIT, hpu_tx_ring_submit_t *):
+		if (copy_from_user(&tx_submit, arg,
+				   sizeof(hpu_tx_ring_submit_t)))
+			goto cfuser_err;
+		res = hpu_tx_ring_submit(priv, &tx_submit);
+		break;
+
+	case _IOW(0x0, HPU_IOCTL_SET_TX_ISSUE_POLICY, hpu_tx_issue_policy_t *):
+		if (copy_from_user(&issue_policy, arg,
+				   sizeof(hpu_tx_issue_policy_t)))
+			goto cfuser_err;
+		if (!priv->dma_tx_chan) {
+			res = -ENODEV;
+			break;
+		}
+		/* stats restart, so that they refer to the new setting */
+		mutex_lock(&priv->dma_tx_pool.mutex_lock);
+		hf->tx_issue_bufs = issue_policy.max_bufs;
+		hf->tx_issue_us = issue_policy.max_us;
+		spin_lock_bh(&priv->dma_tx_pool.spin_lock);
+		memset(&priv->tx_lat_stats, 0, sizeof(priv->tx_lat_stats));
+		spin_unlock_bh(&priv->dma_tx_pool.spin_lock);
+		mutex_unlock(&priv->dma_tx_pool.mutex_lock);
+		break;
+
+	case _IOR(0x0, HPU_IOCTL_GET_TX_LAT_STATS, hpu_tx_lat_stats_t *):
+		mutex_lock(&priv->dma_tx_pool.mutex_lock);
+		spin_lock_bh(&priv->dma_tx_pool.spin_lock);
+		lat_stats = priv->tx_lat_stats;
+		spin_unlock_bh(&priv->dma_tx_pool.spin_lock);
+		mutex_unlock(&priv->dma_tx_pool.mutex_lock);
+		if (copy_to_user(arg, &lat_stats, sizeof(hpu_tx_lat_stats_t)))
+			goto cfuser_err;
+		break;
+
+	case _IOW(0x0, HPU_IOCTL_SET_TX_QUEUE, hpu_tx_queue_cfg_t *):
+		if (copy_from_user(&queue_cfg, arg, sizeof(hpu_tx_queue_cfg_t)))
+			goto cfuser_err;
+		res = hpu_set_tx_queue(priv, &queue_cfg);
+		break;
+
+	case _IOW(0x0, HPU_IOCTL_SET_TX_PATTERN, hpu_tx_pattern_t *):
+		if (copy_from_user(&pattern, arg, sizeof(hpu_tx_pattern_t)))
+			goto cfuser_err;
+		res = hpu_set_tx_pattern(priv, &pattern);
+		break;
+
+	case _IOR(0x0, HPU_IOCTL_GET_TX_PATTERN_STATS, hpu_tx_pattern_stats_t *):
+		spin_lock_bh(&priv->dma_tx_pool.spin_lock);
+		pattern_stats = priv->tx_pattern_stats;
+		spin_unlock_bh(&priv->dma_tx_pool.spin_lock);
+		if (copy_to_user(arg, &pattern_stats,
+				 sizeof(hpu_tx_pattern_stats_t)))
+			goto cfuser_err;
+		break;
+
+	case _IOR(0x0, HPU_IOCTL_GET_STATS, hpu_stats_t *):
+		res = hpu_get_stats(priv, arg);
+		break;
+
+	case _IO(0x0, HPU_IOCTL_RESET_STATS):
+		hpu_stats_reset(priv);
+		break;
+
+	case _IOW(0x0, HPU_IOCTL_SET_TX_EVENTFD, int *):
+		if (copy_from_user(&fd, arg, sizeof(int)))
+			goto cfuser_err;
+		res = hpu_set_tx_eventfd(priv, fd);
+		break;
+
+	case _IOR(0x0, HPU_IOCTL_GET_TX_BYTES_DONE, u64 *):
+		spin_lock_bh(&priv->dma_tx_pool.spin_lock);
+		bytes = priv->tx_bytes_done;
+		spin_unlock_bh(&priv->dma_tx_pool.spin_lock);
+		if (copy_to_user(arg, &bytes, sizeof(u64)))
+			goto cfuser_err;
+		break;
+
+	case _IOW(0x0, HPU_IOCTL_SET_TX_WC, unsigned int *):
+		if (copy_from_user(&val, arg, sizeof(unsigned int)))
+			goto cfuser_err;
+		res = hpu_set_tx_wc(priv, val);
+		break;
+
+	case _IOW(0x0, HPU_IOCTL_SET_TX_DMA_CFG, hpu_tx_dma_cfg_t *):
+		if (copy_from_user(&tx_dma_cfg, arg, sizeof(hpu_tx_dma_cfg_t)))
+			goto cfuser_err;
+		if (!priv->dma_tx_chan) {
+			res = -ENODEV;
+			break;
+		}
+		mutex_lock(&priv->dma_tx_pool.mutex_lock);
+		priv->tx_max_chain = tx_dma_cfg.max_chain;
+		priv->tx_zc_thr = tx_dma_cfg.zerocopy_thr;
+		mutex_unlock(&priv->dma_tx_pool.mutex_lock);
+		break;
+
+	case _IOW(0x0, HPU_IOCTL_SET_RX_MAX_LAG, unsigned int *):
+		if (copy_from_user(&val, arg, sizeof(unsigned int)))
+			goto cfuser_err;
+		mutex_lock(&priv->dma_rx_pool.mutex_lock);
+		if (val < priv->dma_rx_pool.pn) {
+			priv->rx_max_lag = val;
+			/* slow readers might have to skip ahead right now */
+			hpu_rx_readers_release(priv);
+		} else {
+			res = -EINVAL;
+		}
+		mutex_unlock(&priv->dma_rx_pool.mutex_lock);
+		break;
+
 	case _IOW(0x0, HPU_IOCTL_SET_TX_TS_ENABLE, unsigned int *):
 		if (!priv->can_disable_ts)
 			return -ENOTSUPP;
@@ -2636,10 +6607,12 @@ cfuser_err:
 static struct file_operations hpu_fops = {
 	.open = hpu_chardev_open,
 	.owner = THIS_MODULE,
-	.read = hpu_chardev_read,
-	.write= hpu_chardev_write,
+	.read_iter = hpu_chardev_read_iter,
+	.write_iter = hpu_chardev_write_iter,
 	.release = hpu_chardev_close,
 	.unlocked_ioctl = hpu_ioctl,
+	.mmap = hpu_chardev_mmap,
+	.poll = hpu_chardev_poll,
 };
 
 static int hpu_register_chardev(struct hpu_priv *priv)
@@ -2693,6 +6666,7 @@ static int hpu_probe(struct platform_device *pdev)
 	unsigned int result;
 	u32 ver, tmp;
 	char buf[128];
+	int cpu;
 
 	/* FIXME: handle error path resource free */
 
@@ -2705,14 +6679,58 @@ static int hpu_probe(struct platform_device *pdev)
 	priv->hpu_is_opened = 0;
 	priv->rx_fifo_status = FIFO_OK;
 	priv->rx_ts_disable = priv->tx_ts_disable = false;
+	priv->ring_ctrl = NULL;
+	atomic_set(&priv->rx_ring_mapped, 0);
+	atomic_set(&priv->tx_ring_mapped, 0);
+	atomic_set(&priv->ctrl_mapped, 0);
+	INIT_LIST_HEAD(&priv->rx_readers);
+	priv->rx_nreaders = 0;
+	priv->tx_eventfd = NULL;
+	priv->tx_queue = NULL;
+	priv->tx_queue_batch = NULL;
+	priv->tx_queue_stage = NULL;
+	priv->tx_queue_size = 0;
+	priv->tx_queue_len = 0;
+	priv->tx_queue_seq = 0;
+	priv->tx_queue_stalled = false;
+	priv->tx_pattern_on = false;
+	priv->tx_pattern_stopping = false;
+	memset(&priv->tx_pattern_stats, 0, sizeof(priv->tx_pattern_stats));
+	atomic_set(&priv->stats_epoch, 0);
+	priv->stats = alloc_percpu(struct hpu_pcpu_stats);
+	if (!priv->stats) {
+		dev_err(&pdev->dev, "Can't alloc stats mem\n");
+		kfree(priv);
+		return -ENOMEM;
+	}
+	for_each_possible_cpu(cpu)
+		u64_stats_init(&per_cpu_ptr(priv->stats, cpu)->syncp);
 
 	mutex_init(&priv->access_lock);
+	mutex_init(&priv->map_lock);
+	u64_stats_init(&priv->rx_bytes_syncp);
 	spin_lock_init(&priv->irq_lock);
 
 	platform_set_drvdata(pdev, priv);
 	priv->pdev = pdev;
 	priv->ctrl_reg = 0;
 	INIT_WORK(&priv->rx_housekeeping_work, hpu_rx_housekeeping);
+	INIT_DELAYED_WORK(&priv->rx_coal_work, hpu_rx_coal_work);
+	INIT_WORK(&priv->tx_wc_work, hpu_tx_wc_work);
+	INIT_WORK(&priv->tx_queue_work, hpu_tx_queue_work);
+	INIT_WORK(&priv->tx_pattern_work, hpu_tx_pattern_work);
+	init_waitqueue_head(&priv->tx_queue_wq);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,13,0)
+	hrtimer_init(&priv->tx_wc_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	priv->tx_wc_timer.function = hpu_tx_wc_timer;
+	hrtimer_init(&priv->tx_queue_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	priv->tx_queue_timer.function = hpu_tx_queue_timer;
+#else
+	hrtimer_setup(&priv->tx_wc_timer, hpu_tx_wc_timer, CLOCK_MONOTONIC,
+		      HRTIMER_MODE_REL);
+	hrtimer_setup(&priv->tx_queue_timer, hpu_tx_queue_timer,
+		      CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#endif
 
 	spin_lock_init(&priv->dma_rx_pool.spin_lock);
 	spin_lock_init(&priv->dma_tx_pool.spin_lock);
@@ -2723,9 +6741,12 @@ static int hpu_probe(struct platform_device *pdev)
 	res = platform_get_resource(pdev, IORESOURCE_MEM, 0);
 	priv->reg_base = devm_ioremap_resource(&pdev->dev, res);
 	if (IS_ERR(priv->reg_base)) {
+		long err = PTR_ERR(priv->reg_base);
+
 		dev_err(&pdev->dev, "HPU has no regs in DT\n");
+		free_percpu(priv->stats);
 		kfree(priv);
-		return PTR_ERR(priv->reg_base);
+		return err;
 	}
 
 	priv->clk = devm_clk_get(&pdev->dev, "s_axi_aclk");
@@ -2742,6 +6763,7 @@ static int hpu_probe(struct platform_device *pdev)
 
 	if ((ver >> 8) != HPU_MAGIC) {
 		dev_err(&pdev->dev, "HPU IP Magic not recognized (0x%x)", ver);
+		free_percpu(priv->stats);
 		kfree(priv);
 		return -ENODEV;
 	}
@@ -2761,6 +6783,7 @@ static int hpu_probe(struct platform_device *pdev)
 	default:
 		dev_err(&pdev->dev,
 			"HPU IP has wrong version: 0x%x\n", ver);
+		free_percpu(priv->stats);
 		kfree(priv);
 		return -ENODEV;
 	}
@@ -2792,6 +6815,8 @@ static int hpu_probe(struct platform_device *pdev)
 	priv->irq = platform_get_irq(pdev, 0);
 	if (priv->irq < 0) {
 		dev_err(&pdev->dev, "Error getting irq\n");
+		free_percpu(priv->stats);
+		kfree(priv);
 		return -EPERM;
 	}
 	result =
@@ -2800,6 +6825,8 @@ static int hpu_probe(struct platform_device *pdev)
 	if (result) {
 		dev_err(&pdev->dev, "Error requesting irq: %i\n",
 		       result);
+		free_percpu(priv->stats);
+		kfree(priv);
 		return -EPERM;
 	}
 
@@ -2828,6 +6855,8 @@ static int hpu_probe(struct platform_device *pdev)
 
 	init_completion(&priv->dma_rx_pool.completion);
 	init_completion(&priv->dma_tx_pool.completion);
+	init_waitqueue_head(&priv->dma_rx_pool.poll_wq);
+	init_waitqueue_head(&priv->dma_tx_pool.poll_wq);
 
 	hpu_register_chardev(priv);
 
@@ -2850,6 +6879,24 @@ static int hpu_probe(struct platform_device *pdev)
 		HPU_DEBUGFS_ULONG(priv, byte_txed);
 		HPU_DEBUGFS_ULONG(priv, byte_rxed);
 		HPU_DEBUGFS_ULONG(priv, early_tlast);
+		HPU_DEBUGFS_ULONG(priv, axis_lat_us);
+		HPU_DEBUGFS_ULONG(priv, rx_overflows);
+		HPU_DEBUGFS_U64(priv, "rx_spin_count", rx_wakeup_stats.spin_count);
+		HPU_DEBUGFS_U64(priv, "rx_spin_ns_tot", rx_wakeup_stats.spin_ns_tot);
+		HPU_DEBUGFS_U64(priv, "rx_spin_ns_max", rx_wakeup_stats.spin_ns_max);
+		HPU_DEBUGFS_U64(priv, "rx_sleep_count", rx_wakeup_stats.sleep_count);
+		HPU_DEBUGFS_U64(priv, "rx_sleep_ns_tot", rx_wakeup_stats.sleep_ns_tot);
+		HPU_DEBUGFS_U64(priv, "rx_sleep_ns_max", rx_wakeup_stats.sleep_ns_max);
+		HPU_DEBUGFS_U64(priv, "tx_lat_count", tx_lat_stats.count);
+		HPU_DEBUGFS_U64(priv, "tx_lat_ns_tot", tx_lat_stats.ns_tot);
+		HPU_DEBUGFS_U64(priv, "tx_lat_ns_max", tx_lat_stats.ns_max);
+		HPU_DEBUGFS_U64(priv, "tx_issue_count", tx_lat_stats.issue_count);
+		HPU_DEBUGFS_U64(priv, "tx_issue_ns_tot", tx_lat_stats.issue_ns_tot);
+		HPU_DEBUGFS_U64(priv, "tx_issue_ns_max", tx_lat_stats.issue_ns_max);
+		HPU_DEBUGFS_U64(priv, "tx_pattern_loops", tx_pattern_stats.loops);
+		HPU_DEBUGFS_U64(priv, "tx_pattern_underruns", tx_pattern_stats.underruns);
+		debugfs_create_file("stats", 0644, priv->debugfsdir, priv,
+				    &hpu_stats_fops);
 	}
 
 	return 0;
@@ -2864,6 +6911,7 @@ static int hpu_remove(struct platform_device *pdev)
 	free_irq(priv->irq, pdev);
 
 	hpu_unregister_chardev(priv);
+	free_percpu(priv->stats);
 	kfree(priv);
 	return 0;
 }
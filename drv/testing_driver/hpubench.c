@@ -0,0 +1,122 @@
+/*
+ * hpubench.c
+ *
+ * Measures how long it takes to switch the RX/TX rings geometry at runtime
+ * (HPU_IOCTL_SET_RING_GEOMETRY), alternating between a low-latency setup
+ * (small buffers) and a bulk setup (large buffers).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdint.h>
+
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define IOC_MAGIC_NUMBER		0
+#define IOC_GET_RX_PS			_IOR(IOC_MAGIC_NUMBER, 9, unsigned int *)
+#define IOC_GET_RX_PN			_IOR(IOC_MAGIC_NUMBER, 29, unsigned int *)
+#define IOC_SET_RING_GEOMETRY		_IOWR(IOC_MAGIC_NUMBER, 47, hpu_ring_geometry_t *)
+
+typedef struct {
+	uint32_t rx_ps;
+	uint32_t rx_pn;
+	uint32_t tx_ps;
+	uint32_t tx_pn;
+} hpu_ring_geometry_t;
+
+struct bench {
+	const char *name;
+	hpu_ring_geometry_t geo;
+	double min, max, tot;
+	int count;
+};
+
+double time_diff(struct timespec *start, struct timespec *stop)
+{
+	double ret;
+	ret = (double)(stop->tv_nsec - start->tv_nsec) / 1000.0 / 1000.0 / 1000.0;
+	ret +=  stop->tv_sec - start->tv_sec;
+
+	return ret;
+}
+
+int do_switch(int fd, struct bench *b)
+{
+	hpu_ring_geometry_t geo = b->geo;
+	struct timespec ts1, ts2;
+	double t;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts1);
+	if (ioctl(fd, IOC_SET_RING_GEOMETRY, &geo) < 0) {
+		printf("Error switching to %s geometry: %s\n",
+		       b->name, strerror(errno));
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts2);
+
+	t = time_diff(&ts1, &ts2);
+	if (!b->count || t < b->min)
+		b->min = t;
+	if (!b->count || t > b->max)
+		b->max = t;
+	b->tot += t;
+	b->count++;
+
+	return 0;
+}
+
+int main(int argc, char * argv[])
+{
+	int fd;
+	int i, j;
+	int iter_count = 100;
+	unsigned int rx_ps, rx_pn;
+	struct bench benches[] = {
+		{
+			.name = "low-latency",
+			.geo = { .rx_ps = 256, .rx_pn = 64, .tx_ps = 256, .tx_pn = 64 },
+		},
+		{
+			.name = "bulk",
+			.geo = { .rx_ps = 16384, .rx_pn = 1024, .tx_ps = 16384, .tx_pn = 128 },
+		},
+	};
+
+	if (argc > 1)
+		iter_count = atoi(argv[1]);
+
+	fd = open("/dev/iit-hpu0", O_RDWR);
+	if (fd < 0) {
+		printf("Error in opening iit_hpu0 device!\n");
+		return 1;
+	}
+
+	if (ioctl(fd, IOC_GET_RX_PS, &rx_ps) < 0 ||
+	    ioctl(fd, IOC_GET_RX_PN, &rx_pn) < 0) {
+		printf("Can't read the current RX geometry\n");
+		return 1;
+	}
+	printf("Initial RX geometry: %u x %u bytes\n", rx_pn, rx_ps);
+
+	for (i = 0; i < iter_count; i++)
+		for (j = 0; j < 2; j++)
+			if (do_switch(fd, &benches[j]))
+				return 1;
+
+	for (j = 0; j < 2; j++)
+		printf("to %-12s (RX %5u x %5u bytes): min %.3f ms, avg %.3f ms, max %.3f ms\n",
+		       benches[j].name, benches[j].geo.rx_pn, benches[j].geo.rx_ps,
+		       benches[j].min * 1000.0,
+		       benches[j].tot * 1000.0 / benches[j].count,
+		       benches[j].max * 1000.0);
+
+	close(fd);
+
+	return 0;
+}
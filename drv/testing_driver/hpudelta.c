@@ -0,0 +1,448 @@
+/*
+ * hpudelta.c
+ *
+ * Decoder for the delta encoded RX format (RX_FORMAT_DELTA, see
+ * HPU_IOCTL_SET_RX_FORMAT) and its throughput benchmark.
+ *
+ * Without arguments (or with the number of events) it encodes synthetic
+ * events the same way the driver does, then checks and times the decoder,
+ * both scalar and SIMD (SSSE3 on x86, NEON on ARM, when the compiler targets
+ * them), against just copying raw 8 bytes events.
+ * With "-d [seconds]" it reads delta encoded events from the device and
+ * decodes them on the fly.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#define HAVE_SIMD	"SSSE3"
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_SIMD	"NEON"
+#endif
+
+#define IOC_MAGIC_NUMBER		0
+#define IOC_SET_RX_FORMAT		_IOW(IOC_MAGIC_NUMBER, 52, unsigned int *)
+
+#define RX_FORMAT_DELTA			2
+
+#define CH_LEFT				0x00000000
+#define CH_RIGHT			0x00100000
+
+/* events per RX buffer in the synthetic stream (4KiB buffers) */
+#define BUF_EVENTS			512
+
+typedef struct {
+	uint32_t ts_lo;
+	uint32_t ts_hi;
+	uint32_t count;
+} hpu_rx_delta_sync_t;
+
+struct hpu_event {
+	uint64_t ts;
+	uint32_t addr;
+};
+
+/* for each control byte: how to spread the group over four 32 bits lanes */
+static uint8_t shuf[256][16];
+/* for each control byte: how many data bytes follow it */
+static uint8_t glen[256];
+
+static void init_tables(void)
+{
+	int c, k, b, off, l;
+
+	for (c = 0; c < 256; c++) {
+		off = 0;
+		for (k = 0; k < 4; k++) {
+			l = ((c >> (k * 2)) & 3) + 1;
+			for (b = 0; b < 4; b++)
+				shuf[c][k * 4 + b] = b < l ? off + b : 0x80;
+			off += l;
+		}
+		glen[c] = off;
+	}
+}
+
+static inline void unpack_scalar(const uint8_t *p, uint8_t c, uint32_t v[4])
+{
+	int k, b, l;
+
+	for (k = 0; k < 4; k++) {
+		l = ((c >> (k * 2)) & 3) + 1;
+		v[k] = 0;
+		for (b = 0; b < l; b++)
+			v[k] |= (uint32_t)*p++ << (b * 8);
+	}
+}
+
+/* it reads 16 bytes from p, whatever the group length */
+static inline void unpack_simd(const uint8_t *p, uint8_t c, uint32_t v[4])
+{
+#if defined(__SSSE3__)
+	__m128i d = _mm_loadu_si128((const __m128i *)p);
+
+	d = _mm_shuffle_epi8(d, _mm_loadu_si128((const __m128i *)shuf[c]));
+	_mm_storeu_si128((__m128i *)v, d);
+#elif defined(__aarch64__)
+	vst1q_u32(v, vreinterpretq_u32_u8(vqtbl1q_u8(vld1q_u8(p),
+						     vld1q_u8(shuf[c]))));
+#elif defined(__ARM_NEON)
+	uint8x8x2_t t = { { vld1_u8(p), vld1_u8(p + 8) } };
+	uint8x16_t r = vcombine_u8(vtbl2_u8(t, vld1_u8(shuf[c])),
+				   vtbl2_u8(t, vld1_u8(shuf[c] + 8)));
+
+	vst1q_u32(v, vreinterpretq_u32_u8(r));
+#else
+	unpack_scalar(p, c, v);
+#endif
+}
+
+/*
+ * Decode the whole blocks found in len bytes from in. Returns how many
+ * events have been put in out, and sets *used to how many bytes they come
+ * from: a block that is not complete is left for the next call.
+ */
+size_t delta_decode(const uint8_t *in, size_t len, struct hpu_event *out,
+		    size_t *used, int simd)
+{
+	const uint8_t *p = in, *end = in + len, *blk = in;
+	hpu_rx_delta_sync_t sync;
+	struct hpu_event *o = out, *oblk = out;
+	uint32_t v[4], i, addr;
+	uint64_t ts;
+	uint8_t c;
+
+	while (end - p >= (long)sizeof(sync)) {
+		blk = p;
+		memcpy(&sync, p, sizeof(sync));
+		p += sizeof(sync);
+		ts = ((uint64_t)sync.ts_hi << 32) | sync.ts_lo;
+		addr = 0;
+
+		for (i = 0; i < sync.count; i += 2) {
+			if (p >= end || end - p < 1 + glen[*p])
+				goto partial;
+			c = *p++;
+			if (simd && end - p >= 16)
+				unpack_simd(p, c, v);
+			else
+				unpack_scalar(p, c, v);
+			p += glen[c];
+
+			ts += v[0];
+			addr ^= v[1];
+			o->ts = ts;
+			o->addr = addr;
+			o++;
+			if (i + 1 < sync.count) {
+				ts += v[2];
+				addr ^= v[3];
+				o->ts = ts;
+				o->addr = addr;
+				o++;
+			}
+		}
+		blk = p;
+		oblk = o;
+	}
+
+partial:
+	*used = blk - in;
+	return oblk - out;
+}
+
+/* the same as the driver does, see hpu_rx_stage_delta() */
+static uint8_t *put(uint8_t *p, uint32_t val, uint8_t *ctrl, int shift)
+{
+	int len = 1 + (val > 0xff) + (val > 0xffff) + (val > 0xffffff);
+
+	*ctrl |= (len - 1) << shift;
+	while (len--) {
+		*p++ = val;
+		val >>= 8;
+	}
+
+	return p;
+}
+
+static size_t delta_encode(const struct hpu_event *ev, size_t n, uint8_t *out)
+{
+	hpu_rx_delta_sync_t sync;
+	uint8_t *p = out, *blk = NULL, *ctrl = NULL;
+	uint32_t prev_addr = 0, count = 0;
+	uint64_t prev = 0;
+	size_t i;
+
+	for (i = 0; i <= n; i++) {
+		if (i == n || !blk || ev[i].ts - prev > UINT32_MAX) {
+			if (blk) {
+				memcpy(&sync, blk, sizeof(sync));
+				sync.count = count;
+				memcpy(blk, &sync, sizeof(sync));
+				if (count % 2) {
+					*p++ = 0;
+					*p++ = 0;
+				}
+			}
+			if (i == n)
+				break;
+			blk = p;
+			sync.ts_lo = ev[i].ts;
+			sync.ts_hi = ev[i].ts >> 32;
+			sync.count = 0;
+			memcpy(p, &sync, sizeof(sync));
+			p += sizeof(sync);
+			prev = ev[i].ts;
+			prev_addr = 0;
+			count = 0;
+		}
+
+		if (!(count % 2)) {
+			ctrl = p++;
+			*ctrl = 0;
+		}
+		p = put(p, ev[i].ts - prev, ctrl, (count % 2) * 4);
+		p = put(p, ev[i].addr ^ prev_addr, ctrl, (count % 2) * 4 + 2);
+		prev = ev[i].ts;
+		prev_addr = ev[i].addr;
+		count++;
+	}
+
+	return p - out;
+}
+
+static uint32_t rnd_state = 2463534242u;
+
+static uint32_t rnd(void)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return rnd_state;
+}
+
+/* a stereo DVS-like stream: short time deltas, clustered addresses */
+static void gen_events(struct hpu_event *ev, size_t n)
+{
+	uint64_t ts = 0x7fff0000;
+	uint32_t x = 152, y = 120;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		/* mostly few ticks apart, sometimes much more */
+		ts += (rnd() % 16) ? rnd() % 64 : rnd() % 100000;
+		x = (x + rnd() % 9 - 4) % 304;
+		y = (y + rnd() % 9 - 4) % 240;
+		ev[i].ts = ts;
+		ev[i].addr = ((rnd() & 1) ? CH_RIGHT : CH_LEFT) |
+			(y << 10) | (x << 1) | (rnd() & 1);
+	}
+}
+
+double time_diff(struct timespec *start, struct timespec *stop)
+{
+	double ret;
+	ret = (double)(stop->tv_nsec - start->tv_nsec) / 1000.0 / 1000.0 / 1000.0;
+	ret +=  stop->tv_sec - start->tv_sec;
+
+	return ret;
+}
+
+static int bench(size_t n, int iter_count)
+{
+	struct hpu_event *ev, *dec;
+	uint32_t *raw;
+	uint8_t *enc;
+	size_t enc_len = 0, used, i, j, got;
+	struct timespec ts1, ts2;
+	double t;
+	int simd, it;
+
+	ev = malloc(n * sizeof(*ev));
+	dec = malloc(n * sizeof(*dec));
+	raw = malloc(n * 8);
+	enc = malloc(n * 23 + 16);
+	if (!ev || !dec || !raw || !enc) {
+		printf("Out of memory\n");
+		return 1;
+	}
+
+	gen_events(ev, n);
+	for (i = 0; i < n; i++) {
+		raw[i * 2] = ev[i].ts;
+		raw[i * 2 + 1] = ev[i].addr;
+	}
+	/* one sync point each RX buffer, as the driver does */
+	for (i = 0; i < n; i += BUF_EVENTS)
+		enc_len += delta_encode(ev + i, n - i < BUF_EVENTS ?
+					n - i : BUF_EVENTS, enc + enc_len);
+
+	printf("%zu events: raw %zu bytes, delta %zu bytes (%.2f bytes/event, %.1f%%)\n",
+	       n, n * 8, enc_len, (double)enc_len / n, enc_len * 100.0 / (n * 8));
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts1);
+	for (it = 0; it < iter_count; it++)
+		memcpy(dec, raw, n * 8);
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts2);
+	t = time_diff(&ts1, &ts2) / iter_count;
+	printf("%-8s %8.1f Mevents/s %8.1f MB/s in\n", "raw copy",
+	       n / t / 1e6, n * 8 / t / 1e6);
+
+	for (simd = 0; simd < 2; simd++) {
+#ifndef HAVE_SIMD
+		if (simd)
+			break;
+#endif
+		clock_gettime(CLOCK_MONOTONIC_RAW, &ts1);
+		for (it = 0; it < iter_count; it++)
+			got = delta_decode(enc, enc_len, dec, &used, simd);
+		clock_gettime(CLOCK_MONOTONIC_RAW, &ts2);
+		t = time_diff(&ts1, &ts2) / iter_count;
+
+		if (got != n || used != enc_len) {
+			printf("Decoded %zu events out of %zu\n", got, n);
+			return 1;
+		}
+		for (j = 0; j < n; j++)
+			if (dec[j].ts != ev[j].ts || dec[j].addr != ev[j].addr) {
+				printf("Wrong event %zu\n", j);
+				return 1;
+			}
+
+#ifdef HAVE_SIMD
+		printf("%-8s %8.1f Mevents/s %8.1f MB/s in\n",
+		       simd ? HAVE_SIMD : "scalar", n / t / 1e6, enc_len / t / 1e6);
+#else
+		printf("%-8s %8.1f Mevents/s %8.1f MB/s in\n",
+		       "scalar", n / t / 1e6, enc_len / t / 1e6);
+#endif
+	}
+
+	free(ev);
+	free(dec);
+	free(raw);
+	free(enc);
+
+	return 0;
+}
+
+static int read_dev(int seconds)
+{
+	unsigned int format = RX_FORMAT_DELTA;
+	size_t size = 1024 * 1024, len = 0, used, got;
+	size_t tot_events = 0, tot_bytes = 0;
+	struct hpu_event *dec;
+	struct timespec ts1, ts2;
+	uint8_t *buf;
+	ssize_t ret;
+	double t = 0;
+	int fd;
+
+	fd = open("/dev/iit-hpu0", O_RDWR);
+	if (fd < 0) {
+		printf("Error in opening iit_hpu0 device!\n");
+		return 1;
+	}
+
+	if (ioctl(fd, IOC_SET_RX_FORMAT, &format) < 0) {
+		printf("Can't select the delta RX format: %s\n", strerror(errno));
+		return 1;
+	}
+
+	buf = malloc(size);
+	/* at best a 5 bytes group holds two events */
+	dec = malloc((size * 2 / 5 + 1) * sizeof(*dec));
+	if (!buf || !dec) {
+		printf("Out of memory\n");
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts1);
+	while (t < seconds) {
+		ret = read(fd, buf + len, size - len);
+		if (ret < 0) {
+			printf("Error reading: %s\n", strerror(errno));
+			return 1;
+		}
+		len += ret;
+		tot_bytes += ret;
+
+		got = delta_decode(buf, len, dec, &used, 1);
+		tot_events += got;
+		/* keep the last, not complete, block for the next round */
+		memmove(buf, buf + used, len - used);
+		len -= used;
+
+		clock_gettime(CLOCK_MONOTONIC_RAW, &ts2);
+		t = time_diff(&ts1, &ts2);
+	}
+
+	printf("%zu events, %zu bytes (%.2f bytes/event) in %.1f s: %.1f Kevents/s\n",
+	       tot_events, tot_bytes,
+	       tot_events ? (double)tot_bytes / tot_events : 0.0, t,
+	       tot_events / t / 1e3);
+
+	free(buf);
+	free(dec);
+	close(fd);
+
+	return 0;
+}
+
+int help_bail(char **argv)
+{
+	fprintf(stderr, "usage:\n");
+	fprintf(stderr, "%s [events]\n", argv[0]);
+	fprintf(stderr, "%s -d [seconds]\n", argv[0]);
+	return -1;
+}
+
+/* a positive number, or the default when missing */
+static int get_count(const char *arg, long def, long *val)
+{
+	char *end;
+
+	if (!arg) {
+		*val = def;
+		return 0;
+	}
+
+	errno = 0;
+	*val = strtol(arg, &end, 0);
+	if (errno || end == arg || *end || *val <= 0)
+		return -1;
+
+	return 0;
+}
+
+int main(int argc, char * argv[])
+{
+	long val;
+
+	init_tables();
+
+	if (argc > 1 && !strcmp(argv[1], "-d")) {
+		if (argc > 3 || get_count(argv[2], 10, &val) || val > INT_MAX)
+			return help_bail(argv);
+		return read_dev(val);
+	}
+
+	if (argc > 2 || get_count(argv[1], 1000000, &val) ||
+	    val > SIZE_MAX / 23 - 1)
+		return help_bail(argv);
+
+	return bench(val, 20);
+}
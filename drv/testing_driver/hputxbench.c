@@ -0,0 +1,140 @@
+/*
+ * hputxbench.c
+ *
+ * Sweeps the write() size and measures the TX throughput with each way the
+ * driver can hand the data to the DMA (HPU_IOCTL_SET_TX_DMA_CFG): one DMA
+ * descriptor per TX buffer, TX buffers chained in scatter-gather descriptors,
+ * and zero-copy DMA straight from the user pages.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdint.h>
+
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define IOC_MAGIC_NUMBER		0
+#define IOC_SET_TX_DMA_CFG		_IOW(IOC_MAGIC_NUMBER, 55, hpu_tx_dma_cfg_t *)
+
+typedef struct {
+	uint32_t max_chain;
+	uint32_t zerocopy_thr;
+} hpu_tx_dma_cfg_t;
+
+struct path {
+	const char *name;
+	hpu_tx_dma_cfg_t cfg;
+};
+
+double time_diff(struct timespec *start, struct timespec *stop)
+{
+	double ret;
+	ret = (double)(stop->tv_nsec - start->tv_nsec) / 1000.0 / 1000.0 / 1000.0;
+	ret +=  stop->tv_sec - start->tv_sec;
+
+	return ret;
+}
+
+/* returns MB/s, or a negative value on error */
+double do_run(int fd, struct path *p, uint32_t *buf, size_t size, size_t total)
+{
+	hpu_tx_dma_cfg_t cfg = p->cfg;
+	struct timespec ts1, ts2;
+	size_t done = 0;
+	ssize_t ret;
+
+	if (ioctl(fd, IOC_SET_TX_DMA_CFG, &cfg) < 0) {
+		printf("Error selecting the %s path: %s\n",
+		       p->name, strerror(errno));
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts1);
+	while (done < total) {
+		ret = write(fd, buf, size);
+		if (ret < 0) {
+			printf("Error writing %zu bytes (%s path): %s\n",
+			       size, p->name, strerror(errno));
+			return -1;
+		}
+		done += ret;
+	}
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts2);
+
+	return done / time_diff(&ts1, &ts2) / 1000.0 / 1000.0;
+}
+
+int main(int argc, char * argv[])
+{
+	int fd;
+	int j;
+	size_t size, total = 64 << 20;
+	size_t min_size = 256, max_size = 4 << 20;
+	uint32_t *buf;
+	double mbs;
+	struct path paths[] = {
+		{
+			.name = "single",
+			.cfg = { .max_chain = 1, .zerocopy_thr = 0 },
+		},
+		{
+			.name = "sg",
+			.cfg = { .max_chain = 0, .zerocopy_thr = 0 },
+		},
+		{
+			.name = "zero-copy",
+			.cfg = { .max_chain = 0, .zerocopy_thr = 8 },
+		},
+	};
+
+	if (argc > 1)
+		total = (size_t)atoi(argv[1]) << 20;
+
+	fd = open("/dev/iit-hpu0", O_RDWR);
+	if (fd < 0) {
+		printf("Error in opening iit_hpu0 device!\n");
+		return 1;
+	}
+
+	/* page aligned, so that zero-copy is never refused */
+	if (posix_memalign((void **)&buf, 4096, max_size)) {
+		printf("Can't allocate the TX buffer\n");
+		return 1;
+	}
+	/* events with zero timestamp (sent ASAP) and increasing address */
+	for (j = 0; j < max_size / 8; j++) {
+		buf[j * 2] = 0;
+		buf[j * 2 + 1] = j & 0xfffff;
+	}
+
+	printf("%10s", "size");
+	for (j = 0; j < 3; j++)
+		printf(" %12s", paths[j].name);
+	printf("   (MB/s, %zu MB per run)\n", total >> 20);
+
+	for (size = min_size; size <= max_size; size *= 4) {
+		printf("%10zu", size);
+		for (j = 0; j < 3; j++) {
+			mbs = do_run(fd, &paths[j], buf, size, total);
+			if (mbs < 0)
+				return 1;
+			printf(" %12.1f", mbs);
+		}
+		printf("\n");
+	}
+
+	/* back to the defaults */
+	paths[1].cfg.zerocopy_thr = 0;
+	ioctl(fd, IOC_SET_TX_DMA_CFG, &paths[1].cfg);
+
+	free(buf);
+	close(fd);
+
+	return 0;
+}
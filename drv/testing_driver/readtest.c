@@ -22,6 +22,7 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 
 
 /****************************************************************
@@ -132,6 +133,36 @@ double time_diff(struct timespec *start, struct timespec *stop)
 	return ret;
 }
 
+/*
+ * Get the CPU time (in clock ticks) spent system-wide, not counting idle and
+ * iowait. The driver does most of its job in DMA callbacks (softirq), that
+ * are not accounted to this process, so look at the whole system.
+ */
+int cpu_busy_ticks(unsigned long long *busy)
+{
+	unsigned long long user, nice, sys, idle, iowait, irq, softirq, steal;
+	FILE *f;
+	int ret;
+
+	f = fopen("/proc/stat", "r");
+	if (!f)
+		return -1;
+	ret = fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+		     &user, &nice, &sys, &idle, &iowait, &irq, &softirq, &steal);
+	fclose(f);
+	if (ret != 8)
+		return -1;
+
+	*busy = user + nice + sys + irq + softirq + steal;
+	return 0;
+}
+
+double rusage_sec(struct rusage *ru)
+{
+	return ru->ru_utime.tv_sec + ru->ru_stime.tv_sec +
+		(ru->ru_utime.tv_usec + ru->ru_stime.tv_usec) / 1000000.0;
+}
+
 int main(int argc, char * argv[])
 {
 	int ret;
@@ -144,6 +175,10 @@ int main(int argc, char * argv[])
 	int iter_count = 1000;
 	int rx_size = 8192 * 4;
 	int tot_data;
+	double tot_mb;
+	unsigned long long busy1 = 0, busy2 = 0;
+	int busy_ok;
+	struct rusage ru1, ru2;
 
 	signal(SIGPIPE, SIG_IGN);
 	signal(SIGTERM, handle_kill);
@@ -178,6 +213,8 @@ int main(int argc, char * argv[])
 	val = 500;
 	ioctl(iit_hpu, IOC_SET_AXIS_LATENCY, &val);
 
+	busy_ok = !cpu_busy_ticks(&busy1);
+	getrusage(RUSAGE_SELF, &ru1);
 	clock_gettime(CLOCK_MONOTONIC_RAW, &ts1);
 	for (i = 0; i < iter_count; i++) {
 		ret = read(iit_hpu, data, 8 * rx_size);
@@ -185,6 +222,8 @@ int main(int argc, char * argv[])
 			printf("err TX %d\n", ret);
 	}
 	clock_gettime(CLOCK_MONOTONIC_RAW, &ts2);
+	getrusage(RUSAGE_SELF, &ru2);
+	busy_ok = busy_ok && !cpu_busy_ticks(&busy2);
 
 	tot_data = 8 * rx_size * iter_count;
 	time_sec = time_diff(&ts1, &ts2);
@@ -192,5 +231,13 @@ int main(int argc, char * argv[])
 	printf("RX throughtput %f MBps\n",
 	       (double)tot_data / time_sec / 1024.0 / 1024.0);
 
+	tot_mb = (double)tot_data / 1024.0 / 1024.0;
+	printf("CPU per MB (this process) %f ms\n",
+	       (rusage_sec(&ru2) - rusage_sec(&ru1)) * 1000.0 / tot_mb);
+	if (busy_ok)
+		printf("CPU per MB (system-wide) %f ms\n",
+		       (double)(busy2 - busy1) * 1000.0 /
+		       sysconf(_SC_CLK_TCK) / tot_mb);
+
 	return 0;
 }
@@ -315,11 +315,11 @@ void fill_fifo(int rx_ps, int rx_pn, spinn_loop_t loop_type, int rx_ts, int tx_t
 	fflush(stdout);
 	for (i = 0; i < rx_pn; i++) {
 		write_data(rx_ps / 4 / k / h, /*rx_pn*/ 1);
-		usleep(100);
+		fsync(iit_hpu);
 	}
 	for (i = 0; i < 8; i++) {
 		write_data(1024 / 4 / 2 / h, /*rx_pn*/ 1);
-		usleep(100);
+		fsync(iit_hpu);
 	}
 #warning tweak_for_last_boot.bin_fifo_size___needs_better_handling
 	write_data(8 / k - (rx_ts ? 1 : 3) / h, /*rx_pn*/ 1);